@@ -0,0 +1,161 @@
+/**
+ * 	@file	Arduino.h
+ * 	@brief	Minimal Arduino core for building the SM130 drivers on a host machine
+ *
+ *	<p>
+ *	Time is virtual: it only advances through delay(), through the cost of
+ *	the bus and serial transfers, and by host::cpuCost for every call that
+ *	reads the clock or polls a port, so busy-wait loops terminate and their
+ *	cost shows up in the measurements. Emulated devices (see sm130sim.h)
+ *	derive from host::Device and are ticked whenever time advances.
+ *	</p>
+ *	<p>
+ *	Build with -DARDUINO=10800 and this directory first on the include path.
+ *	</p>
+ */
+
+#ifndef HOST_ARDUINO_h
+#define HOST_ARDUINO_h
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdlib.h>
+
+typedef uint8_t byte;
+typedef bool boolean;
+
+#define HIGH 1
+#define LOW 0
+
+#define INPUT 0
+#define OUTPUT 1
+#define INPUT_PULLUP 2
+
+#define CHANGE 1
+#define FALLING 2
+#define RISING 3
+
+#define DEC 10
+#define HEX 16
+
+#define NUM_DIGITAL_PINS 64
+#define NOT_AN_INTERRUPT -1
+#define digitalPinToInterrupt(p) ((p) < NUM_DIGITAL_PINS ? (p) : NOT_AN_INTERRUPT)
+
+#define PROGMEM
+#define pgm_read_byte(addr) (*(const uint8_t*)(addr))
+#define memcpy_P memcpy
+
+#ifndef min
+#define min(a,b) ((a)<(b)?(a):(b))
+#endif
+#ifndef max
+#define max(a,b) ((a)>(b)?(a):(b))
+#endif
+
+unsigned long millis();
+unsigned long micros();
+void delay(unsigned long ms);
+void delayMicroseconds(unsigned int us);
+
+void pinMode(uint8_t pin, uint8_t mode);
+void digitalWrite(uint8_t pin, uint8_t val);
+int digitalRead(uint8_t pin);
+
+void attachInterrupt(uint8_t interrupt, void (*isr)(), int mode);
+void detachInterrupt(uint8_t interrupt);
+inline void noInterrupts() {}
+inline void interrupts() {}
+
+/**	Text and binary output, as in the Arduino core.
+ */
+class Print
+{
+public:
+	virtual ~Print() {}
+	virtual size_t write(uint8_t b) = 0;
+	virtual size_t write(const uint8_t* buffer, size_t size);
+	size_t write(const char* str) { return write((const uint8_t*)str, strlen(str)); }
+	virtual int availableForWrite() { return 0; }
+	virtual void flush() {}
+
+	size_t print(const char* str);
+	size_t print(char c);
+	size_t print(unsigned char n, int base = DEC) { return print((unsigned long)n, base); }
+	size_t print(int n, int base = DEC) { return print((long)n, base); }
+	size_t print(unsigned int n, int base = DEC) { return print((unsigned long)n, base); }
+	size_t print(long n, int base = DEC);
+	size_t print(unsigned long n, int base = DEC);
+
+	size_t println();
+	template <class T> size_t println(T value) { size_t n = print(value); return n + println(); }
+	template <class T> size_t println(T value, int base) { size_t n = print(value, base); return n + println(); }
+};
+
+/**	Byte stream input, as in the Arduino core.
+ */
+class Stream : public Print
+{
+public:
+	virtual int available() = 0;
+	virtual int read() = 0;
+	virtual int peek() = 0;
+	size_t readBytes(uint8_t* buffer, size_t length);
+};
+
+/**	Serial port. The global Serial writes to stdout and never receives.
+ */
+class HardwareSerial : public Stream
+{
+public:
+	virtual void begin(unsigned long baud) { (void)baud; }
+	virtual void end() {}
+	virtual int available() { return 0; }
+	virtual int read() { return -1; }
+	virtual int peek() { return -1; }
+	virtual size_t write(uint8_t b);
+	virtual int availableForWrite() { return 64; }
+	using Print::write;
+	operator bool() { return true; }
+};
+
+extern HardwareSerial Serial;
+
+/**	Control of the emulated machine.
+ */
+namespace host
+{
+	//! Virtual time in microseconds
+	uint64_t now();
+	//! Advance virtual time, ticking all devices
+	void advance(uint64_t us);
+	//! Virtual cost in microseconds of each clock read or port poll (default 4)
+	extern unsigned long cpuCost;
+	//! Drive an input pin, firing attached interrupts
+	void setPin(uint8_t pin, uint8_t level);
+
+	/**	Emulated device, ticked whenever virtual time advances.
+	 */
+	class Device
+	{
+	public:
+		Device();
+		virtual ~Device();
+		//! Called with the current time after each advance
+		virtual void tick(uint64_t now) = 0;
+		//! Called when the sketch writes an output pin
+		virtual void pinWritten(uint8_t pin, uint8_t level) { (void)pin; (void)level; }
+		//! Called when the sketch writes to this device on the I2C bus
+		virtual void i2cReceive(const uint8_t* buffer, size_t length) { (void)buffer; (void)length; }
+		//! Called when the sketch reads from this device on the I2C bus, returns bytes sent
+		virtual size_t i2cRequest(uint8_t* buffer, size_t length) { (void)buffer; (void)length; return 0; }
+	};
+
+	//! Attach a device to an I2C address
+	void attachI2C(uint8_t address, Device* device);
+	//! Returns the device at an I2C address, or 0
+	Device* i2cDevice(uint8_t address);
+}
+
+#endif // HOST_ARDUINO_h
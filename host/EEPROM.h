@@ -0,0 +1,51 @@
+/**
+ * 	@file	EEPROM.h
+ * 	@brief	EEPROM for the host build, 1 KB as on the ATmega328P
+ *
+ *	<p>
+ *	A write costs 3.3 ms of virtual time, as the EEPROM programming time of
+ *	the AVR, and is counted per cell so wear can be checked.
+ *	</p>
+ */
+
+#ifndef HOST_EEPROM_h
+#define HOST_EEPROM_h
+
+#include "Arduino.h"
+
+#define E2END 0x3FF
+
+/**	EEPROM with the read(), write() and update() of the AVR library.
+ */
+class EEPROMClass
+{
+	uint8_t cells[E2END + 1];
+	unsigned long writes[E2END + 1];
+
+public:
+	EEPROMClass()
+	{
+		memset(cells, 0xff, sizeof(cells)); // erased
+		memset(writes, 0, sizeof(writes));
+	}
+	uint8_t read(int address) { return cells[address]; }
+	void write(int address, uint8_t value)
+	{
+		host::advance(3300);
+		cells[address] = value;
+		writes[address]++;
+	}
+	void update(int address, uint8_t value)
+	{
+		if (cells[address] != value)
+			write(address, value);
+	}
+	uint16_t length() { return E2END + 1; }
+
+	//! Returns the number of writes to a cell
+	unsigned long writeCount(int address) { return writes[address]; }
+};
+
+static EEPROMClass EEPROM;
+
+#endif // HOST_EEPROM_h
@@ -0,0 +1,44 @@
+/**
+ * 	@file	Wire.h
+ * 	@brief	I2C master for the host build, connected to host::Device instances
+ */
+
+#ifndef HOST_WIRE_h
+#define HOST_WIRE_h
+
+#include "Arduino.h"
+
+#define BUFFER_LENGTH 32
+
+/**	I2C master. Transfers cost 9 bit times per byte plus address at the bus clock.
+ */
+class TwoWire : public Stream
+{
+	uint8_t txAddress;
+	uint8_t txBuffer[BUFFER_LENGTH];
+	uint8_t txLength;
+	uint8_t rxBuffer[BUFFER_LENGTH];
+	uint8_t rxIndex;
+	uint8_t rxLength;
+	unsigned long clock;
+
+	void busTime(size_t bytes);
+
+public:
+	TwoWire();
+	void begin() {}
+	void setClock(unsigned long frequency) { clock = frequency; }
+	void beginTransmission(uint8_t address);
+	uint8_t endTransmission(bool stop = true);
+	uint8_t requestFrom(uint8_t address, uint8_t quantity);
+	uint8_t requestFrom(int address, int quantity) { return requestFrom((uint8_t)address, (uint8_t)quantity); }
+	virtual size_t write(uint8_t b);
+	virtual int available();
+	virtual int read();
+	virtual int peek();
+	using Print::write;
+};
+
+extern TwoWire Wire;
+
+#endif // HOST_WIRE_h
@@ -0,0 +1,221 @@
+/**
+ * 	@file	XBee.h
+ * 	@brief	XBee library for the host build, enough of it for xbeetxqueue.h
+ *
+ *	<p>
+ *	Follows the classes of the XBee-Arduino library: requests are written
+ *	as API frames with escaping (API mode 2) to the serial port given to
+ *	setSerial(), and readPacket() parses received frames without waiting.
+ *	Two XBee objects on connected ports talk to each other, so a check can
+ *	play the radio by reading the frames sent and answering them.
+ *	</p>
+ */
+
+#ifndef HOST_XBEE_h
+#define HOST_XBEE_h
+
+#include "Arduino.h"
+
+#define START_BYTE 0x7e
+#define ESCAPE 0x7d
+#define XON 0x11
+#define XOFF 0x13
+
+#define TX_16_REQUEST 0x01
+#define TX_STATUS_RESPONSE 0x89
+
+#define SUCCESS 0x0
+#define NO_ACK 0x1
+#define CCA_FAILURE 0x2
+#define PURGED 0x3
+
+#define MAX_FRAME_DATA_SIZE 110
+
+/**	Received API frame.
+ */
+class XBeeResponse
+{
+public:
+	XBeeResponse() { reset(); }
+	uint8_t getApiId() { return frameData[0]; }
+	//! Returns the frame data after the API ID
+	uint8_t* getFrameData() { return frameData + 1; }
+	//! Returns the number of frame data bytes after the API ID
+	uint8_t getFrameDataLength() { return length - 1; }
+	boolean isAvailable() { return complete; }
+	void getTxStatusResponse(XBeeResponse& response);
+	void reset() { length = 0; complete = false; }
+
+	uint8_t frameData[MAX_FRAME_DATA_SIZE + 1]; //!< API ID and frame data
+	uint8_t length; //!< bytes of frameData
+	boolean complete;
+};
+
+/**	TX status of a frame sent with a frame ID.
+ */
+class TxStatusResponse : public XBeeResponse
+{
+public:
+	uint8_t getFrameId() { return getFrameData()[0]; }
+	uint8_t getStatus() { return getFrameData()[1]; }
+	boolean isSuccess() { return getStatus() == SUCCESS; }
+};
+
+inline void XBeeResponse::getTxStatusResponse(XBeeResponse& response)
+{
+	memcpy(response.frameData, frameData, length);
+	response.length = length;
+	response.complete = complete;
+}
+
+/**	API frame to send.
+ */
+class XBeeRequest
+{
+	uint8_t apiId;
+	uint8_t frameId;
+
+public:
+	XBeeRequest(uint8_t apiId, uint8_t frameId) : apiId(apiId), frameId(frameId) {}
+	virtual ~XBeeRequest() {}
+	void setFrameId(uint8_t frameId) { this->frameId = frameId; }
+	uint8_t getFrameId() { return frameId; }
+	uint8_t getApiId() { return apiId; }
+	//! Returns a byte of the frame data after the API ID and frame ID
+	virtual uint8_t getFrameData(uint8_t pos) = 0;
+	//! Returns the number of frame data bytes after the API ID and frame ID
+	virtual uint8_t getFrameDataLength() = 0;
+};
+
+/**	Payload to a 16-bit address.
+ */
+class Tx16Request : public XBeeRequest
+{
+	uint16_t addr16;
+	uint8_t* payload;
+	uint8_t payloadLength;
+
+public:
+	Tx16Request(uint16_t addr16, uint8_t* data, uint8_t dataLength) :
+		XBeeRequest(TX_16_REQUEST, 1), addr16(addr16), payload(data), payloadLength(dataLength) {}
+	virtual uint8_t getFrameData(uint8_t pos)
+	{
+		if (pos == 0)
+			return addr16 >> 8;
+		if (pos == 1)
+			return addr16 & 0xff;
+		if (pos == 2)
+			return 0; // options
+		return payload[pos - 3];
+	}
+	virtual uint8_t getFrameDataLength() { return 3 + payloadLength; }
+};
+
+/**	XBee radio on a serial port.
+ */
+class XBee
+{
+	Stream* serial;
+	XBeeResponse response;
+	uint8_t pos; //!< bytes of the frame being received, after the start byte
+	uint16_t frameLength;
+	uint8_t checksum;
+	boolean escape;
+
+	void sendByte(uint8_t b, boolean escaped)
+	{
+		if (escaped && (b == START_BYTE || b == ESCAPE || b == XON || b == XOFF))
+		{
+			serial->write(ESCAPE);
+			serial->write(b ^ 0x20);
+		}
+		else
+			serial->write(b);
+	}
+
+public:
+	XBee() : serial(0), pos(0), frameLength(0), checksum(0), escape(false) {}
+	void setSerial(Stream& serial) { this->serial = &serial; }
+	XBeeResponse& getResponse() { return response; }
+
+	//! Write a request as an API frame
+	void send(XBeeRequest& request)
+	{
+		uint8_t length = request.getFrameDataLength() + 2;
+		sendByte(START_BYTE, false);
+		sendByte(0, true);
+		sendByte(length, true);
+		sendByte(request.getApiId(), true);
+		sendByte(request.getFrameId(), true);
+		uint8_t sum = request.getApiId() + request.getFrameId();
+		for (uint8_t i = 0; i < request.getFrameDataLength(); i++)
+		{
+			sendByte(request.getFrameData(i), true);
+			sum += request.getFrameData(i);
+		}
+		sendByte(0xff - sum, true);
+	}
+
+	//! Parse the bytes received so far, isAvailable() of the response is true once a frame is complete
+	void readPacket()
+	{
+		if (response.isAvailable())
+		{
+			response.reset();
+			pos = 0;
+		}
+		while (serial->available() > 0)
+		{
+			uint8_t b = serial->read();
+			if (b == START_BYTE)
+			{
+				// a start byte always begins a frame, even in the middle of another
+				response.reset();
+				pos = 1;
+				checksum = 0;
+				escape = false;
+				continue;
+			}
+			if (pos == 0)
+				continue;
+			if (b == ESCAPE)
+			{
+				escape = true;
+				continue;
+			}
+			if (escape)
+			{
+				b ^= 0x20;
+				escape = false;
+			}
+			if (pos == 1)
+				frameLength = b << 8;
+			else if (pos == 2)
+				frameLength |= b;
+			else if (pos - 3 < frameLength)
+			{
+				if (response.length > MAX_FRAME_DATA_SIZE)
+				{
+					pos = 0;
+					continue;
+				}
+				response.frameData[response.length++] = b;
+				checksum += b;
+			}
+			else
+			{
+				pos = 0;
+				if ((uint8_t)(checksum + b) == 0xff && frameLength > 0)
+				{
+					response.complete = true;
+					return;
+				}
+				response.reset();
+				continue;
+			}
+			pos++;
+		}
+	}
+};
+
+#endif // HOST_XBEE_h
@@ -0,0 +1,296 @@
+/**
+ * 	@file	arduino.cpp
+ * 	@brief	Minimal Arduino core for building the SM130 drivers on a host machine
+ */
+
+#include <stdio.h>
+
+#include "Arduino.h"
+#include "Wire.h"
+
+#define MAX_DEVICES 8
+
+namespace host
+{
+	unsigned long cpuCost = 4;
+
+	static uint64_t clock;
+	static Device* devices[MAX_DEVICES];
+	static Device* i2cDevices[128];
+	static uint8_t pins[NUM_DIGITAL_PINS];
+	static void (*isrs[NUM_DIGITAL_PINS])();
+	static uint8_t isrModes[NUM_DIGITAL_PINS];
+	static boolean ticking;
+
+	uint64_t now()
+	{
+		return clock;
+	}
+
+	void advance(uint64_t us)
+	{
+		clock += us;
+
+		// devices may drive pins that fire interrupts, which may read the clock
+		if (ticking)
+			return;
+		ticking = true;
+		for (byte i = 0; i < MAX_DEVICES; i++)
+		{
+			if (devices[i])
+				devices[i]->tick(clock);
+		}
+		ticking = false;
+	}
+
+	void setPin(uint8_t pin, uint8_t level)
+	{
+		if (pin >= NUM_DIGITAL_PINS)
+			return;
+		uint8_t old = pins[pin];
+		pins[pin] = level ? HIGH : LOW;
+		if (isrs[pin] == 0 || old == pins[pin])
+			return;
+		if (isrModes[pin] == CHANGE
+			|| (isrModes[pin] == RISING && pins[pin] == HIGH)
+			|| (isrModes[pin] == FALLING && pins[pin] == LOW))
+		{
+			isrs[pin]();
+		}
+	}
+
+	Device::Device()
+	{
+		for (byte i = 0; i < MAX_DEVICES; i++)
+		{
+			if (devices[i] == 0)
+			{
+				devices[i] = this;
+				return;
+			}
+		}
+		fprintf(stderr, "host: too many devices\n");
+		abort();
+	}
+
+	Device::~Device()
+	{
+		for (byte i = 0; i < MAX_DEVICES; i++)
+		{
+			if (devices[i] == this)
+				devices[i] = 0;
+		}
+		for (byte i = 0; i < 128; i++)
+		{
+			if (i2cDevices[i] == this)
+				i2cDevices[i] = 0;
+		}
+	}
+
+	void attachI2C(uint8_t address, Device* device)
+	{
+		i2cDevices[address & 0x7f] = device;
+	}
+
+	Device* i2cDevice(uint8_t address)
+	{
+		return i2cDevices[address & 0x7f];
+	}
+}
+
+/* Timing *********************************************************************/
+
+unsigned long millis()
+{
+	host::advance(host::cpuCost);
+	return (unsigned long)(host::now() / 1000);
+}
+
+unsigned long micros()
+{
+	host::advance(host::cpuCost);
+	return (unsigned long)host::now();
+}
+
+void delay(unsigned long ms)
+{
+	host::advance((uint64_t)ms * 1000);
+}
+
+void delayMicroseconds(unsigned int us)
+{
+	host::advance(us);
+}
+
+/* Digital IO *****************************************************************/
+
+void pinMode(uint8_t pin, uint8_t mode)
+{
+	if (pin < NUM_DIGITAL_PINS && mode == INPUT_PULLUP)
+		host::pins[pin] = HIGH;
+}
+
+void digitalWrite(uint8_t pin, uint8_t val)
+{
+	if (pin >= NUM_DIGITAL_PINS)
+		return;
+	host::pins[pin] = val ? HIGH : LOW;
+	for (byte i = 0; i < MAX_DEVICES; i++)
+	{
+		if (host::devices[i])
+			host::devices[i]->pinWritten(pin, host::pins[pin]);
+	}
+}
+
+int digitalRead(uint8_t pin)
+{
+	host::advance(host::cpuCost);
+	return pin < NUM_DIGITAL_PINS ? host::pins[pin] : LOW;
+}
+
+void attachInterrupt(uint8_t interrupt, void (*isr)(), int mode)
+{
+	if (interrupt < NUM_DIGITAL_PINS)
+	{
+		host::isrs[interrupt] = isr;
+		host::isrModes[interrupt] = mode;
+	}
+}
+
+void detachInterrupt(uint8_t interrupt)
+{
+	if (interrupt < NUM_DIGITAL_PINS)
+		host::isrs[interrupt] = 0;
+}
+
+/* Print / Stream *************************************************************/
+
+size_t Print::write(const uint8_t* buffer, size_t size)
+{
+	size_t n = 0;
+	while (size--)
+		n += write(*buffer++);
+	return n;
+}
+
+size_t Print::print(const char* str)
+{
+	return write(str);
+}
+
+size_t Print::print(char c)
+{
+	return write((uint8_t)c);
+}
+
+size_t Print::print(long n, int base)
+{
+	if (n < 0 && base == DEC)
+		return print('-') + print((unsigned long)-n, base);
+	return print((unsigned long)n, base);
+}
+
+size_t Print::print(unsigned long n, int base)
+{
+	char buf[8 * sizeof(long) + 1];
+	char* s = &buf[sizeof(buf) - 1];
+	*s = 0;
+	do
+	{
+		byte digit = n % base;
+		*--s = digit < 10 ? digit + '0' : digit + 'A' - 10;
+		n /= base;
+	} while (n);
+	return write(s);
+}
+
+size_t Print::println()
+{
+	return write("\r\n");
+}
+
+size_t Stream::readBytes(uint8_t* buffer, size_t length)
+{
+	size_t n = 0;
+	while (n < length && available())
+		buffer[n++] = read();
+	return n;
+}
+
+size_t HardwareSerial::write(uint8_t b)
+{
+	return fputc(b, stdout) == EOF ? 0 : 1;
+}
+
+HardwareSerial Serial;
+
+/* Wire ***********************************************************************/
+
+TwoWire::TwoWire()
+{
+	txLength = rxIndex = rxLength = 0;
+	clock = 100000;
+}
+
+void TwoWire::busTime(size_t bytes)
+{
+	// start + address + data + stop, 9 bits per byte
+	host::advance(((bytes + 1) * 9 + 2) * 1000000ULL / clock);
+}
+
+void TwoWire::beginTransmission(uint8_t address)
+{
+	txAddress = address;
+	txLength = 0;
+}
+
+uint8_t TwoWire::endTransmission(bool stop)
+{
+	(void)stop;
+	busTime(txLength);
+	host::Device* device = host::i2cDevice(txAddress);
+	if (device == 0)
+		return 2; // address NACK
+	device->i2cReceive(txBuffer, txLength);
+	return 0;
+}
+
+uint8_t TwoWire::requestFrom(uint8_t address, uint8_t quantity)
+{
+	if (quantity > BUFFER_LENGTH)
+		quantity = BUFFER_LENGTH;
+	rxIndex = rxLength = 0;
+	busTime(quantity);
+	host::Device* device = host::i2cDevice(address);
+	if (device == 0)
+		return 0;
+	memset(rxBuffer, 0, quantity);
+	device->i2cRequest(rxBuffer, quantity);
+	rxLength = quantity;
+	return rxLength;
+}
+
+size_t TwoWire::write(uint8_t b)
+{
+	if (txLength >= BUFFER_LENGTH)
+		return 0;
+	txBuffer[txLength++] = b;
+	return 1;
+}
+
+int TwoWire::available()
+{
+	return rxLength - rxIndex;
+}
+
+int TwoWire::read()
+{
+	return rxIndex < rxLength ? rxBuffer[rxIndex++] : -1;
+}
+
+int TwoWire::peek()
+{
+	return rxIndex < rxLength ? rxBuffer[rxIndex] : -1;
+}
+
+TwoWire Wire;
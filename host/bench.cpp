@@ -0,0 +1,296 @@
+/**
+ * 	@file	bench.cpp
+ * 	@brief	Throughput and latency benchmark of the SM130 drivers against SM130Sim
+ *
+ *	<p>
+ *	Runs the same workload on SM130 over I2C (polling and with DREADY
+ *	interrupt) and on NFCReader over UART, and reports side by side:
+ *	</p>
+ *	<ul>
+ *	<li>tags per second for back-to-back seeks with a tag in the field</li>
+ *	<li>round-trip latency percentiles per command</li>
+ *	<li>time to dump a Mifare 1K and 4K card with dumpCard()</li>
+ *	<li>blocks dumped when SELECT_TAG gets no response, which must be 0</li>
+ *	</ul>
+ *	<p>
+ *	All times are virtual time of the host build, see host/Arduino.h.
+ *	Usage: bench [iterations [jitter_us]], default 100 iterations and 1000us jitter
+ *	</p>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "Arduino.h"
+#include "Wire.h"
+#include "sm130i2c.h"
+#include "sm130uart.h"
+#include "sm130sim.h"
+
+#define MAX_SAMPLES 1000
+#define SEEK_TIME 5000 // ms of continuous seeking
+
+enum { DRIVER_I2C_POLL, DRIVER_I2C_DREADY, DRIVER_UART, DRIVER_COUNT };
+enum { LAT_SELECT, LAT_AUTHENTICATE, LAT_READ16, LAT_HALT, LAT_COUNT };
+
+static const char* driverNames[DRIVER_COUNT] = { "SM130 I2C poll", "SM130 I2C DREADY", "NFCReader UART" };
+static const char* latencyNames[LAT_COUNT] = { "SELECT_TAG", "AUTHENTICATE", "READ16", "HALT_TAG" };
+
+/**	Latency samples of one command in microseconds.
+ */
+struct Samples
+{
+	unsigned long value[MAX_SAMPLES];
+	int count;
+
+	void add(unsigned long us) { if (count < MAX_SAMPLES) value[count++] = us; }
+	double percentile(int p);
+};
+
+static int compare(const void* a, const void* b)
+{
+	unsigned long x = *(const unsigned long*)a, y = *(const unsigned long*)b;
+	return x < y ? -1 : x > y;
+}
+
+double Samples::percentile(int p)
+{
+	if (count == 0)
+		return 0;
+	qsort(value, count, sizeof(value[0]), compare);
+	int i = (p * count + 99) / 100 - 1;
+	return value[i < 0 ? 0 : i] / 1000.0;
+}
+
+/**	Results of one driver.
+ */
+struct Result
+{
+	double tagsPerSecond;
+	Samples latency[LAT_COUNT];
+	double dump1K;
+	double dump4K;
+	unsigned int blocks1K;
+	unsigned int blocks4K;
+	unsigned int blocksNoResponse; //!< blocks dumped while every response is dropped
+};
+
+static int iterations = 100;
+static unsigned long jitter = 1000;
+static Result results[DRIVER_COUNT];
+static byte buffer[4096];
+static unsigned int dumped; //!< number of blocks in buffer
+
+/**	Dump sink copying the blocks into the buffer. Stops the dump at a block out of order.
+ */
+static boolean toBuffer(byte block, const byte* data)
+{
+	if (block != dumped)
+		return false;
+	memcpy(buffer + 16 * dumped++, data, 16);
+	return true;
+}
+
+/**	Create a simulator with a 1K and a 4K tag, the 1K tag in the field.
+ */
+static SM130Sim* createSim(int* tag1K, int* tag4K)
+{
+	static const byte uid1K[4] = { 0x12, 0x34, 0x56, 0x78 };
+	static const byte uid4K[7] = { 0x04, 0x11, 0x22, 0x33, 0x44, 0x55, 0x66 };
+
+	SM130Sim* sim = new SM130Sim();
+	sim->setJitter(jitter);
+	*tag1K = sim->addTag(SM130Sim::MIFARE_1K, uid1K, sizeof(uid1K));
+	*tag4K = sim->addTag(SM130Sim::MIFARE_4K, uid4K, sizeof(uid4K));
+	sim->setInField(*tag1K, true);
+	return sim;
+}
+
+/**	Run the workload on SM130 over I2C.
+ */
+static void benchI2C(Result& result, boolean dready)
+{
+	int tag1K, tag4K;
+	SM130Sim* sim = createSim(&tag1K, &tag4K);
+	sim->attachI2C(0x42, dready ? 2 : 0xff, 3);
+
+	SM130 nfc;
+	nfc.pinRESET = 3;
+	nfc.pinDREADY = dready ? 2 : 0xff;
+	nfc.useInterrupt = dready;
+	nfc.reset();
+	nfc.getFirmwareVersion();
+
+	// continuous seek
+	unsigned long tags = 0;
+	unsigned long start = millis();
+	while (millis() - start < SEEK_TIME)
+	{
+		nfc.seekTag();
+		while (!nfc.available());
+		if (nfc.getTagType() != 0)
+			tags++;
+	}
+	result.tagsPerSecond = tags * 1000.0 / (millis() - start);
+
+	// command latency, alternating sectors so authentication isn't cached
+	for (int i = 0; i < iterations; i++)
+	{
+		unsigned long t = micros();
+		nfc.selectTag();
+		while (!nfc.available());
+		result.latency[LAT_SELECT].add(micros() - t);
+
+		byte block = 4 + 4 * (i & 1);
+		t = micros();
+		nfc.authenticate(block);
+		while (!nfc.available());
+		result.latency[LAT_AUTHENTICATE].add(micros() - t);
+
+		t = micros();
+		nfc.readBlock(block);
+		while (!nfc.available());
+		result.latency[LAT_READ16].add(micros() - t);
+
+		t = micros();
+		nfc.haltTag();
+		while (!nfc.available());
+		result.latency[LAT_HALT].add(micros() - t);
+	}
+
+	// full card dumps
+	dumped = 0;
+	start = millis();
+	result.blocks1K = nfc.dumpCard(toBuffer);
+	result.dump1K = (millis() - start) / 1000.0;
+
+	sim->setInField(tag1K, false);
+	sim->setInField(tag4K, true);
+	dumped = 0;
+	start = millis();
+	result.blocks4K = nfc.dumpCard(toBuffer);
+	result.dump4K = (millis() - start) / 1000.0;
+
+	// dump without response to SELECT_TAG
+	sim->setFaultCommand(SM130::CMD_SELECT_TAG);
+	sim->setFaultEvery(SM130Sim::FAULT_DROP, 1);
+	dumped = 0;
+	result.blocksNoResponse = nfc.dumpCard(toBuffer);
+
+	delete sim;
+}
+
+/**	Run the workload on NFCReader over UART.
+ */
+static void benchUART(Result& result)
+{
+	int tag1K, tag4K;
+	SM130Sim* sim = createSim(&tag1K, &tag4K);
+	byte uid[8], length;
+	byte data[20];
+	static byte key[6] = { 0xff, 0xff, 0xff, 0xff, 0xff, 0xff };
+
+	NFCReader nfc;
+	nfc.setSerial(sim->serial());
+	nfc.getFirmwareVersion(data, sizeof(data));
+
+	// continuous seek
+	unsigned long tags = 0;
+	unsigned long start = millis();
+	while (millis() - start < SEEK_TIME)
+	{
+		if (nfc.waitForTagID(uid, &length) == 1)
+			tags++;
+	}
+	result.tagsPerSecond = tags * 1000.0 / (millis() - start);
+
+	// command latency, alternating sectors so authentication isn't cached
+	for (int i = 0; i < iterations; i++)
+	{
+		unsigned long t = micros();
+		nfc.readTagID(uid, &length);
+		result.latency[LAT_SELECT].add(micros() - t);
+
+		byte block = 4 + 4 * (i & 1);
+		t = micros();
+		nfc.authenticate(block, 0xff, key);
+		result.latency[LAT_AUTHENTICATE].add(micros() - t);
+
+		t = micros();
+		nfc.readBlock(block, data);
+		result.latency[LAT_READ16].add(micros() - t);
+
+		t = micros();
+		nfc.haltTag();
+		result.latency[LAT_HALT].add(micros() - t);
+	}
+
+	// full card dumps
+	dumped = 0;
+	start = millis();
+	result.blocks1K = nfc.dumpCard(toBuffer);
+	result.dump1K = (millis() - start) / 1000.0;
+
+	sim->setInField(tag1K, false);
+	sim->setInField(tag4K, true);
+	dumped = 0;
+	start = millis();
+	result.blocks4K = nfc.dumpCard(toBuffer);
+	result.dump4K = (millis() - start) / 1000.0;
+
+	// dump without response to SELECT_TAG
+	sim->setFaultCommand(SM130::CMD_SELECT_TAG);
+	sim->setFaultEvery(SM130Sim::FAULT_DROP, 1);
+	dumped = 0;
+	result.blocksNoResponse = nfc.dumpCard(toBuffer);
+
+	delete sim;
+}
+
+int main(int argc, char* argv[])
+{
+	if (argc > 1)
+		iterations = min(atoi(argv[1]), MAX_SAMPLES);
+	if (argc > 2)
+		jitter = strtoul(argv[2], 0, 10);
+
+	Wire.begin();
+	benchI2C(results[DRIVER_I2C_POLL], false);
+	benchI2C(results[DRIVER_I2C_DREADY], true);
+	benchUART(results[DRIVER_UART]);
+
+	printf("%-26s", "");
+	for (int d = 0; d < DRIVER_COUNT; d++)
+		printf("%18s", driverNames[d]);
+	printf("\n\n%-26s", "seek (tags/s)");
+	for (int d = 0; d < DRIVER_COUNT; d++)
+		printf("%18.1f", results[d].tagsPerSecond);
+	printf("\n");
+
+	static const int percentiles[] = { 50, 90, 99, 100 };
+	for (int c = 0; c < LAT_COUNT; c++)
+	{
+		printf("\n");
+		for (unsigned p = 0; p < sizeof(percentiles) / sizeof(percentiles[0]); p++)
+		{
+			char label[32];
+			snprintf(label, sizeof(label), "%s p%d (ms)", latencyNames[c], percentiles[p]);
+			printf("%-26s", label);
+			for (int d = 0; d < DRIVER_COUNT; d++)
+				printf("%18.2f", results[d].latency[c].percentile(percentiles[p]));
+			printf("\n");
+		}
+	}
+
+	printf("\n%-26s", "dump 1K (s)");
+	for (int d = 0; d < DRIVER_COUNT; d++)
+		printf("%13.2f%5u", results[d].dump1K, results[d].blocks1K);
+	printf("\n%-26s", "dump 4K (s)");
+	for (int d = 0; d < DRIVER_COUNT; d++)
+		printf("%13.2f%5u", results[d].dump4K, results[d].blocks4K);
+	printf("\n%-26s", "dump, no response (blocks)");
+	for (int d = 0; d < DRIVER_COUNT; d++)
+		printf("%18u", results[d].blocksNoResponse);
+	printf("\n");
+	return 0;
+}
@@ -0,0 +1,520 @@
+/**
+ * 	@file	checks.cpp
+ * 	@brief	Functional checks of the SM130 drivers and the xbee-sm130 helpers
+ *
+ *	<p>
+ *	Each check drives a driver against SM130Sim, or a sketch helper against
+ *	the host core, and prints one line per expectation. The exit code is
+ *	the number of failed expectations, 0 when all pass. Covered:
+ *	</p>
+ *	<ul>
+ *	<li>the SM130 command queue when full, and dumps and value transactions
+ *	that get no response</li>
+ *	<li>the authentication session cache of both drivers</li>
+ *	<li>NFCReader baud rate negotiation, and its fallback</li>
+ *	<li>SM130WriteBatch across sectors, and writes whose echo doesn't match</li>
+ *	<li>XBeeTxQueue, TagCache and EventLog of the xbee-sm130 sketch</li>
+ *	</ul>
+ *	<p>
+ *	All times are virtual time of the host build, see host/Arduino.h.
+ *	</p>
+ */
+
+#include <stdio.h>
+
+#include "Arduino.h"
+#include "Wire.h"
+#include "EEPROM.h"
+#include "XBee.h"
+#include "bufferedserial.h"
+#include "sm130i2c.h"
+#include "sm130uart.h"
+#include "sm130sim.h"
+#include "../xbee-sm130/xbeetxqueue.h"
+#include "../xbee-sm130/tagcache.h"
+#include "../xbee-sm130/eventlog.h"
+
+static int failures;
+
+/**	Print an expectation and count it if it failed.
+ */
+static void expect(boolean ok, const char* what)
+{
+	printf("  %s %s\n", ok ? "ok  " : "FAIL", what);
+	if (!ok)
+		failures++;
+}
+
+static const byte uid1K[4] = { 0x12, 0x34, 0x56, 0x78 };
+
+/**	Create a simulator with a 1K tag in the field.
+ */
+static SM130Sim* createSim()
+{
+	SM130Sim* sim = new SM130Sim();
+	sim->setInField(sim->addTag(SM130Sim::MIFARE_1K, uid1K, sizeof(uid1K)), true);
+	return sim;
+}
+
+/**	Create an SM130 on the simulator's I2C bus, without DREADY and RESET pins.
+ */
+static void beginI2C(SM130Sim* sim, SM130& nfc)
+{
+	sim->attachI2C(0x42);
+	nfc.pinRESET = 0xff;
+	nfc.pinDREADY = 0xff;
+	nfc.reset();
+}
+
+/**	Connect an NFCReader to the simulator's UART and select the tag.
+ */
+static void beginUART(SM130Sim* sim, NFCReader& nfc)
+{
+	byte data[20], length;
+	nfc.setSerial(sim->serial());
+	nfc.getFirmwareVersion(data, sizeof(data));
+	nfc.readTagID(data, &length);
+}
+
+static unsigned int dumped; //!< number of blocks passed to countBlocks()
+
+static boolean countBlocks(byte block, const byte* data)
+{
+	(void)block;
+	(void)data;
+	dumped++;
+	return true;
+}
+
+/**	A full queue refuses commands, and the queued ones are all answered.
+ */
+static void checkQueue()
+{
+	printf("SM130 command queue\n");
+	SM130Sim* sim = createSim();
+	SM130 nfc;
+	beginI2C(sim, nfc);
+	nfc.async = true;
+
+	int accepted = 0;
+	while (accepted < 2 * SIZE_QUEUE && nfc.selectTag())
+		accepted++;
+	expect(accepted > 0 && accepted < 2 * SIZE_QUEUE, "a full queue refuses the command");
+	expect(nfc.queued() == SIZE_QUEUE, "the queue holds SIZE_QUEUE commands");
+
+	int answered = 0;
+	unsigned long start = millis();
+	while (nfc.busy() && millis() - start < 2000)
+	{
+		if (nfc.available() && nfc.getCommand() == SM130::CMD_SELECT_TAG)
+			answered++;
+	}
+	expect(answered == accepted, "every accepted command is answered");
+	expect(nfc.selectTag(), "a drained queue accepts commands again");
+	while (!nfc.available());
+	delete sim;
+}
+
+/**	Dumps stop when SELECT_TAG gets no response.
+ */
+static void checkDumpNoResponse()
+{
+	printf("dumpCard without response\n");
+	SM130Sim* sim = createSim();
+	SM130 i2c;
+	beginI2C(sim, i2c);
+	dumped = 0;
+	expect(i2c.dumpCard(countBlocks) == 64 && dumped == 64, "SM130 dumps all 64 blocks of a 1K tag");
+	sim->setFaultCommand(SM130::CMD_SELECT_TAG);
+	sim->setFaultEvery(SM130Sim::FAULT_DROP, 1);
+	dumped = 0;
+	expect(i2c.dumpCard(countBlocks) == 0 && dumped == 0, "SM130 dumps no block");
+	delete sim;
+
+	sim = createSim();
+	NFCReader uart;
+	beginUART(sim, uart);
+	sim->setFaultCommand(SM130::CMD_SELECT_TAG);
+	sim->setFaultEvery(SM130Sim::FAULT_DROP, 1);
+	dumped = 0;
+	expect(uart.dumpCard(countBlocks) == 0 && dumped == 0, "NFCReader dumps no block");
+	delete sim;
+}
+
+/**	Debits and credits, with balance check and without response.
+ */
+static void checkValue()
+{
+	printf("value transactions\n");
+	SM130Sim* sim = createSim();
+	SM130 i2c;
+	beginI2C(sim, i2c);
+	i2c.selectTag();
+	while (!i2c.available());
+	SM130WriteBatch batch;
+	batch.writeValueBlock(8, 100);
+	expect(i2c.execute(batch) == SM130_DONE, "SM130 writes the value block");
+	expect(i2c.debit(8, 30, 100) == SM130_DONE && i2c.getBlockValue() == 70, "SM130 debit 30 of 100 leaves 70");
+	expect(i2c.debit(8, 30, 100) == SM130_VALUE_MISMATCH && i2c.getBlockValue() == 70, "SM130 debit expecting 100 of 70 changes nothing");
+	expect(i2c.credit(8, 5) == SM130_DONE && i2c.getBlockValue() == 75, "SM130 credit 5 without balance check leaves 75");
+	sim->setFaultCommand(SM130::CMD_DEC_VALUE);
+	sim->setFaultEvery(SM130Sim::FAULT_DROP, 1);
+	expect(i2c.debit(8, 5) == SM130_NO_RESPONSE, "SM130 debit without response fails");
+	delete sim;
+
+	sim = createSim();
+	NFCReader uart;
+	beginUART(sim, uart);
+	int32_t balance = 0;
+	uart.authenticate(8, 0xff, 0);
+	expect(uart.writeValueBlock(8, 100) == SM130_DONE, "NFCReader writes the value block");
+	expect(uart.debit(8, 30, 100, 0xff, 0, &balance) == SM130_DONE && balance == 70, "NFCReader debit 30 of 100 leaves 70");
+	expect(uart.debit(8, 30, 100, 0xff, 0, &balance) == SM130_VALUE_MISMATCH && balance == 70, "NFCReader debit expecting 100 of 70 changes nothing");
+	sim->setFaultCommand(SM130::CMD_READ_VALUE);
+	sim->setFaultEvery(SM130Sim::FAULT_DROP, 1);
+	expect(uart.debit(8, 5, 70, 0xff, 0, &balance) == SM130_NO_RESPONSE, "NFCReader debit without balance fails");
+	sim->setFaultEvery(SM130Sim::FAULT_DROP, 0);
+	expect(uart.readValueBlock(8, &balance) == SM130_DONE && balance == 70, "NFCReader failed debit changes nothing");
+	delete sim;
+}
+
+/**	A sector is authenticated once per key, stored keys are sent by number.
+ */
+static void checkSession()
+{
+	printf("authentication session cache\n");
+	SM130Sim* sim = createSim();
+	SM130 i2c;
+	beginI2C(sim, i2c);
+	i2c.selectTag();
+	while (!i2c.available());
+	i2c.authenticate(4);
+	while (!i2c.available());
+	unsigned long commands = sim->commands;
+	i2c.authenticate(5);
+	expect(i2c.available() && i2c.getErrorCode() == 'L', "SM130 reports the cached login");
+	expect(sim->commands == commands, "SM130 sends nothing for a sector already authenticated");
+	i2c.authenticate(6, 0x10, 0);
+	while (!i2c.available());
+	expect(sim->commands == commands + 1 && i2c.getErrorCode() == 'L', "SM130 sends a login with another key");
+	i2c.selectTag();
+	while (!i2c.available());
+	commands = sim->commands;
+	i2c.authenticate(4, 0x10, 0);
+	while (!i2c.available());
+	expect(sim->commands == commands + 1, "SM130 logs in again after SELECT_TAG");
+	delete sim;
+
+	sim = createSim();
+	NFCReader uart;
+	beginUART(sim, uart);
+	expect(uart.authenticate(8, 0xff, 0) == 'L', "NFCReader logs in");
+	commands = sim->commands;
+	expect(uart.authenticate(9, 0xff, 0) == 'L' && sim->commands == commands, "NFCReader sends nothing for a sector already authenticated");
+	expect(uart.authenticate(12, 0x10, 0) == 'L' && sim->commands == commands + 1, "NFCReader sends a login for another sector");
+	byte d[8];
+	expect(SM130Session::authData(d, 4, 0x12, 0) == 2 && d[1] == 0x12, "a stored key is sent by its number");
+	delete sim;
+}
+
+static SM130Sim* baudSim; //!< simulator switched by switchBaud()
+
+static void switchBaud(unsigned long baud)
+{
+	baudSim->serial().begin(baud);
+}
+
+/**	Negotiate the highest baud rate the link supports.
+ */
+static void checkBaud()
+{
+	printf("baud rate negotiation\n");
+	SM130Sim* sim = createSim();
+	baudSim = sim;
+	NFCReader nfc;
+	byte data[20];
+	nfc.setSerial(sim->serial());
+	expect(nfc.setBaudRate(57600) == STATUS_BAUD_FAILED, "no switch without a baud callback");
+	nfc.setBaudCallback(switchBaud);
+	expect(nfc.setBaudRate(12345) == STATUS_BAUD_FAILED, "an unsupported rate is refused");
+	expect(nfc.negotiateBaudRate() == 115200 && sim->getBaudRate() == 115200, "both sides reach 115200");
+	expect(nfc.getFirmwareVersion(data, sizeof(data)) != 0xff, "the link works at 115200");
+	expect(nfc.negotiateBaudRate(38400) == 38400 && sim->getBaudRate() == 38400, "a lower maximum switches down");
+
+	// the link is lost at every new rate
+	sim->setFaultCommand(SM130::CMD_VERSION);
+	sim->setFaultEvery(SM130Sim::FAULT_DROP, 1);
+	expect(nfc.negotiateBaudRate() == 38400 && sim->getBaudRate() == 38400, "a rate at which the link fails falls back");
+	sim->setFaultEvery(SM130Sim::FAULT_DROP, 0);
+	expect(nfc.getFirmwareVersion(data, sizeof(data)) != 0xff, "the link works after the fallback");
+	delete sim;
+}
+
+/**	Batched writes across sectors, and a write echoing other data.
+ */
+static void checkBatch()
+{
+	printf("SM130WriteBatch\n");
+	static const byte data[3][16] = { { 1, 2, 3 }, { 4, 5, 6 }, { 7, 8, 9 } };
+	SM130Sim* sim = createSim();
+	SM130 i2c;
+	beginI2C(sim, i2c);
+	i2c.selectTag();
+	while (!i2c.available());
+	SM130WriteBatch batch;
+	batch.writeBlock(12, data[2]);
+	batch.writeBlock(4, data[0]);
+	batch.writeBlock(8, data[1]);
+	expect(i2c.execute(batch) == SM130_DONE && batch.failed() == batch.count(), "SM130 executes writes to three sectors");
+	expect(memcmp(sim->block(0, 4), data[0], 16) == 0 && memcmp(sim->block(0, 8), data[1], 16) == 0 &&
+		memcmp(sim->block(0, 12), data[2], 16) == 0, "every block holds its data");
+	delete sim;
+
+	sim = createSim();
+	NFCReader uart;
+	beginUART(sim, uart);
+	expect(uart.execute(batch, 0xff, 0) == SM130_DONE, "NFCReader executes writes to three sectors");
+	sim->setFaultCommand(SM130::CMD_WRITE16);
+	sim->setFaultEvery(SM130Sim::FAULT_DATA, 2);
+	expect(uart.execute(batch, 0xff, 0) == SM130_UNVERIFIED && batch.failed() == 1, "a wrong echo stops the batch at that write");
+	delete sim;
+}
+
+/**	Serial port of the radio side, connected to another Pipe.
+ */
+class Pipe : public HardwareSerial
+{
+	byte buffer[1024];
+	size_t head, count;
+
+public:
+	Pipe* peer;
+	int room; //!< bytes that can be written before the port must drain, negative if unlimited
+
+	Pipe() : head(0), count(0), peer(0), room(-1) {}
+	virtual int available() { host::advance(host::cpuCost); return count; }
+	virtual int read()
+	{
+		if (count == 0)
+			return -1;
+		byte b = buffer[head];
+		head = (head + 1) % sizeof(buffer);
+		count--;
+		return b;
+	}
+	virtual int peek() { return count ? buffer[head] : -1; }
+	virtual size_t write(uint8_t b)
+	{
+		if (room > 0)
+			room--;
+		if (peer->count < sizeof(peer->buffer))
+			peer->buffer[(peer->head + peer->count++) % sizeof(peer->buffer)] = b;
+		return 1;
+	}
+	virtual int availableForWrite() { return room < 0 ? 64 : room; }
+	using Print::write;
+};
+
+/**	TX status from the remote end.
+ */
+class TxStatusRequest : public XBeeRequest
+{
+	uint8_t status;
+
+public:
+	TxStatusRequest(uint8_t frameId, uint8_t status) : XBeeRequest(TX_STATUS_RESPONSE, frameId), status(status) {}
+	virtual uint8_t getFrameData(uint8_t pos) { (void)pos; return status; }
+	virtual uint8_t getFrameDataLength() { return 1; }
+};
+
+static uint8_t statuses[8]; //!< statuses reported by txStatus(), in order
+static uint8_t contexts[8]; //!< contexts reported by txStatus(), in order
+static uint8_t reported;
+
+static void txStatus(uint8_t status, const uint8_t* payload, uint8_t length, uint8_t context)
+{
+	(void)payload;
+	(void)length;
+	if (reported < sizeof(statuses))
+	{
+		statuses[reported] = status;
+		contexts[reported++] = context;
+	}
+}
+
+/**	Receive the frames sent so far on the radio side, returns their frame IDs.
+ */
+static uint8_t receiveFrames(XBee& radio, uint8_t* frameIds, uint8_t size)
+{
+	uint8_t n = 0;
+	for (;;)
+	{
+		radio.readPacket();
+		XBeeResponse& response = radio.getResponse();
+		if (!response.isAvailable())
+			return n;
+		if (response.getApiId() == TX_16_REQUEST && n < size)
+			frameIds[n++] = response.getFrameData()[0];
+	}
+}
+
+/**	Frames are sent within the window, whole, and matched with their status.
+ */
+static void checkTxQueue()
+{
+	printf("XBeeTxQueue\n");
+	Pipe local, remote;
+	local.peer = &remote;
+	remote.peer = &local;
+	byte rxBuffer[128], txBuffer[128];
+	BufferedSerial serial(local, rxBuffer, sizeof(rxBuffer), txBuffer, sizeof(txBuffer));
+	XBee xbee, radio;
+	xbee.setSerial(serial);
+	radio.setSerial(remote);
+	XBeeTxQueue queue(xbee, &serial);
+	queue.onStatus(txStatus);
+	reported = 0;
+
+	// worst case payload, every byte escaped
+	uint8_t payload[XBEE_TX_PAYLOAD];
+	memset(payload, 0x7e, sizeof(payload));
+	uint8_t ids[8];
+
+	// a slow port takes nothing for now
+	local.room = 0;
+	for (uint8_t i = 0; i < XBEE_TX_QUEUE; i++)
+		queue.send(0x1234, payload, sizeof(payload), i);
+	expect(queue.full() && !queue.send(0x1234, payload, 1), "a full queue refuses frames");
+	queue.service();
+	expect(serial.txOverflows == 0, "frames wait for room instead of overflowing the ring");
+	local.room = -1;
+	queue.service();
+	queue.service();
+	expect(receiveFrames(radio, ids, sizeof(ids)) == XBEE_TX_WINDOW, "the window limits the frames sent");
+	expect(serial.txOverflows == 0, "no byte was dropped");
+
+	// status out of order
+	TxStatusRequest second(ids[1], SUCCESS), first(ids[0], NO_ACK);
+	radio.send(second);
+	radio.send(first);
+	queue.service();
+	queue.service();
+	expect(reported == 2 && statuses[0] == SUCCESS && contexts[0] == 1 && statuses[1] == NO_ACK && contexts[1] == 0,
+		"statuses are matched by frame ID");
+	queue.service();
+	expect(receiveFrames(radio, ids, sizeof(ids)) == XBEE_TX_WINDOW, "freed slots let the next frames go");
+
+	// no status at all
+	delay(XBEE_TX_TIMEOUT + 1);
+	queue.service();
+	expect(reported == 4 && statuses[2] == XBEE_TX_NO_STATUS && statuses[3] == XBEE_TX_NO_STATUS && queue.queued() == 0,
+		"frames without status time out");
+}
+
+/**	A tag is reported once per tap, and departs after the hold-off time.
+ */
+static void checkTagCache()
+{
+	printf("TagCache\n");
+	static const uint8_t a[4] = { 1, 2, 3, 4 }, b[7] = { 5, 6, 7, 8, 9, 10, 11 }, c[4] = { 4, 3, 2, 1 };
+	TagCache<2> cache(500);
+	uint8_t type, number[TAG_NUMBER_MAX], length;
+	expect(cache.seen(2, a, 4), "a new tag arrives");
+	delay(100);
+	expect(!cache.seen(2, a, 4), "a tag read again within the hold-off time doesn't");
+	expect(!cache.departed(&type, number, &length), "nothing departs within the hold-off time");
+	expect(cache.seen(3, b, 7), "another tag arrives");
+	delay(300);
+	expect(!cache.seen(3, b, 7), "a tag resting on the reader doesn't arrive again");
+	delay(300);
+	expect(cache.departed(&type, number, &length) && type == 2 && length == 4 && memcmp(number, a, 4) == 0,
+		"the tag no longer read departs");
+	expect(!cache.departed(&type, number, &length), "a tag departs once");
+	expect(cache.seen(2, a, 4), "the tag arrives on the next tap");
+	expect(cache.seen(2, c, 4), "a tag arrives when the cache is full");
+	expect(!cache.seen(2, a, 4) && cache.seen(3, b, 7), "it replaces the tag read least recently");
+}
+
+static void serviceLog(EventLog& log)
+{
+	for (int i = 0; i < 1000; i++)
+		log.service();
+}
+
+/**	Events survive a restart and are replayed in order, oldest replaced when full.
+ */
+static void checkEventLog()
+{
+	printf("EventLog\n");
+	const int start = 100;
+	const int size = EVENT_LOG_HEADER + 3 * EVENT_LOG_SLOT;
+	uint8_t data[EVENT_LOG_DATA];
+	uint16_t seq = 0;
+
+	// another sketch's data is formatted, not replayed
+	for (int i = 0; i < size; i++)
+		EEPROM.write(start + i, i * 7);
+	EventLog log(start, size);
+	log.begin();
+	expect(log.pending() == 0 && EEPROM.read(start) == 'E' && EEPROM.read(start + 3) == EVENT_LOG_SLOT,
+		"foreign EEPROM is formatted");
+
+	for (uint8_t i = 0; i < EVENT_LOG_QUEUE; i++)
+	{
+		data[0] = i;
+		log.store(data, 1);
+	}
+	expect(!log.store(data, 1) && log.dropped == 1, "a full RAM queue drops the event");
+	expect(log.pending() == 0, "events are not written by store()");
+	serviceLog(log);
+	expect(log.pending() == 3, "service() writes the queued events");
+
+	data[0] = 3;
+	log.store(data, 1);
+	serviceLog(log);
+	expect(log.pending() == 3 && log.peek(data, &seq) == 1 && data[0] == 1 && seq == 1,
+		"a full log replaces the oldest event");
+	log.remove(seq);
+
+	EventLog restarted(start, size);
+	restarted.begin();
+	expect(restarted.pending() == 2, "undelivered events survive a restart");
+	uint8_t order = 0;
+	while (restarted.peek(data, &seq))
+	{
+		order = order * 10 + data[0];
+		restarted.remove(seq);
+	}
+	expect(order == 23, "they are replayed in order");
+
+	data[0] = 4;
+	restarted.store(data, 1);
+	serviceLog(restarted);
+	EventLog again(start, size);
+	again.begin();
+	expect(again.peek(data, &seq) == 1 && data[0] == 4 && seq == 4, "sequence numbers continue after a restart");
+	unsigned long writes = 0;
+	for (int i = 0; i < 3; i++)
+		writes = max(writes, EEPROM.writeCount(start + EVENT_LOG_HEADER + i * EVENT_LOG_SLOT + 1));
+	expect(writes <= 3, "slots are written in turn");
+}
+
+int main()
+{
+	Wire.begin();
+	checkQueue();
+	checkDumpNoResponse();
+	checkValue();
+	checkSession();
+	checkBaud();
+	checkBatch();
+	checkTxQueue();
+	checkTagCache();
+	checkEventLog();
+
+	if (failures)
+		printf("%d failed\n", failures);
+	else
+		printf("all passed\n");
+	return failures;
+}
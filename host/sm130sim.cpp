@@ -0,0 +1,709 @@
+/**
+ * 	@file	sm130sim.cpp
+ * 	@brief	SonMicro SM130 simulator for the host build
+ */
+
+#include <stdio.h>
+
+#include "Arduino.h"
+#include "sm130sim.h"
+
+#define CMD_RESET 0x80
+#define CMD_VERSION 0x81
+#define CMD_SEEK_TAG 0x82
+#define CMD_SELECT_TAG 0x83
+#define CMD_AUTHENTICATE 0x85
+#define CMD_READ16 0x86
+#define CMD_READ_VALUE 0x87
+#define CMD_WRITE16 0x89
+#define CMD_WRITE_VALUE 0x8a
+#define CMD_WRITE4 0x8b
+#define CMD_WRITE_KEY 0x8c
+#define CMD_INC_VALUE 0x8d
+#define CMD_DEC_VALUE 0x8e
+#define CMD_ANTENNA_POWER 0x90
+#define CMD_READ_PORT 0x91
+#define CMD_WRITE_PORT 0x92
+#define CMD_HALT_TAG 0x93
+#define CMD_SET_BAUD 0x94
+#define CMD_SLEEP 0x96
+
+static const unsigned long baudRates[] = { 9600, 19200, 38400, 57600, 115200 };
+
+SM130Sim::SM130Sim() : port(this)
+{
+	commands = responses = faults = 0;
+	tagCount = 0;
+	strcpy(version, "UM13 2.8");
+	jitter = 0;
+	random = 1;
+	memset(faultEvery, 0, sizeof(faultEvery));
+	memset(faultCount, 0, sizeof(faultCount));
+	faultCommand = 0;
+	memset(keys, 0xff, sizeof(keys));
+
+	// datasheet-like processing times
+	for (uint8_t i = 0; i < 0x17; i++)
+		latency[i] = 1000;
+	setLatency(CMD_RESET, 50000);
+	setLatency(CMD_SEEK_TAG, 8000);
+	setLatency(CMD_SELECT_TAG, 8000);
+	setLatency(CMD_AUTHENTICATE, 4000);
+	setLatency(CMD_READ16, 3000);
+	setLatency(CMD_READ_VALUE, 3000);
+	setLatency(CMD_WRITE16, 10000);
+	setLatency(CMD_WRITE_VALUE, 10000);
+	setLatency(CMD_WRITE4, 6000);
+	setLatency(CMD_INC_VALUE, 12000);
+	setLatency(CMD_DEC_VALUE, 12000);
+
+	address = 0xff;
+	pinDREADY = pinRESET = 0xff;
+	pinResetLevel = LOW;
+	moduleBaud = hostBaud = nextBaud = 19200;
+	memset(&toModule, 0, sizeof(toModule));
+	memset(&fromModule, 0, sizeof(fromModule));
+	frameIndex = 0;
+	clock = 0;
+	reset();
+}
+
+void SM130Sim::attachI2C(uint8_t address, uint8_t pinDREADY, uint8_t pinRESET)
+{
+	this->address = address;
+	this->pinDREADY = pinDREADY;
+	this->pinRESET = pinRESET;
+	host::attachI2C(address, this);
+	if (pinDREADY != 0xff)
+		host::setPin(pinDREADY, LOW);
+}
+
+void SM130Sim::setVersion(const char* version)
+{
+	strncpy(this->version, version, sizeof(this->version) - 1);
+	this->version[sizeof(this->version) - 1] = 0;
+}
+
+int SM130Sim::addTag(uint8_t type, const uint8_t* uid, uint8_t uidLength)
+{
+	if (tagCount == MAX_TAGS || (uidLength != 4 && uidLength != 7))
+		return -1;
+
+	Tag& tag = tags[tagCount];
+	tag.type = type;
+	tag.uidLength = uidLength;
+	memcpy(tag.uid, uid, uidLength);
+	tag.inField = false;
+	memset(tag.memory, 0, sizeof(tag.memory));
+
+	// manufacturer block
+	memcpy(tag.memory, uid, uidLength);
+	if (type != MIFARE_ULTRALIGHT)
+	{
+		// sector trailers with transport keys and default access bits
+		static const uint8_t trailer[16] =
+			{ 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0x07, 0x80, 0x69, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff };
+		for (uint16_t b = 0; b < blockCount(tagCount); b++)
+		{
+			if (trailerOf(sectorOf(b)) == b)
+				memcpy(tag.memory + 16 * b, trailer, 16);
+		}
+	}
+	return tagCount++;
+}
+
+void SM130Sim::setInField(int tag, bool inField)
+{
+	if (tag < 0 || tag >= tagCount)
+		return;
+	tags[tag].inField = inField;
+	if (!inField && selected == tag)
+	{
+		selected = -1;
+		authSector = 0xff;
+	}
+}
+
+uint8_t* SM130Sim::block(int tag, uint8_t block)
+{
+	return tags[tag].memory + 16 * block;
+}
+
+void SM130Sim::setLatency(uint8_t cmd, unsigned long us)
+{
+	if (cmd >= CMD_RESET && cmd <= CMD_SLEEP)
+		latency[cmd - CMD_RESET] = us;
+}
+
+unsigned long SM130Sim::getLatency(uint8_t cmd)
+{
+	return cmd >= CMD_RESET && cmd <= CMD_SLEEP ? latency[cmd - CMD_RESET] : 1000;
+}
+
+void SM130Sim::setFaultEvery(Fault fault, unsigned long n)
+{
+	faultEvery[fault] = n;
+	faultCount[fault] = 0;
+}
+
+/* Device *********************************************************************/
+
+void SM130Sim::tick(uint64_t now)
+{
+	// commands arriving over UART, processed from the time of their last byte
+	while (toModule.count > 0 && toModule.time[toModule.head] <= now)
+	{
+		clock = toModule.time[toModule.head];
+		uartByte(pop(toModule, true));
+		if (responseScheduled && responseTime <= now)
+			deliver();
+	}
+	clock = now;
+
+	// tag found while seeking
+	if (seeking && !responseScheduled && !i2cReady && antenna && tagInField() >= 0)
+	{
+		seeking = false;
+		selected = tagInField();
+		const Tag& tag = tags[selected];
+		uint8_t payload[8];
+		payload[0] = tag.type;
+		memcpy(payload + 1, tag.uid, tag.uidLength);
+		respond(CMD_SEEK_TAG, payload, tag.uidLength + 1, getLatency(CMD_SEEK_TAG));
+	}
+
+	if (responseScheduled && responseTime <= now)
+		deliver();
+}
+
+void SM130Sim::pinWritten(uint8_t pin, uint8_t level)
+{
+	// RESET is active high, the module restarts on the falling edge
+	if (pin == pinRESET)
+	{
+		if (pinResetLevel == HIGH && level == LOW)
+		{
+			reset();
+			asleep = false;
+		}
+		pinResetLevel = level;
+	}
+}
+
+void SM130Sim::i2cReceive(const uint8_t* buffer, size_t length)
+{
+	// length byte, command, payload, checksum
+	if (length < 3 || buffer[0] + 2u != length)
+		return;
+	uint8_t sum = 0;
+	for (size_t i = 0; i < length - 1; i++)
+		sum += buffer[i];
+	if (sum != buffer[length - 1])
+		return;
+	clock = host::now();
+	execute(buffer + 1, buffer[0], false);
+}
+
+size_t SM130Sim::i2cRequest(uint8_t* buffer, size_t length)
+{
+	if (!i2cReady)
+		return length; // zero length packet
+
+	size_t n = min(length, sizeof(i2cBuffer));
+	memcpy(buffer, i2cBuffer, n);
+	i2cReady = false;
+	if (pinDREADY != 0xff)
+		host::setPin(pinDREADY, LOW);
+	return length;
+}
+
+/* UART ***********************************************************************/
+
+void SM130Sim::Port::begin(unsigned long baud)
+{
+	sim->hostBaud = baud;
+}
+
+int SM130Sim::Port::available()
+{
+	host::advance(host::cpuCost);
+	uint64_t now = host::now();
+	int n = 0;
+	for (uint16_t i = 0; i < sim->fromModule.count; i++)
+	{
+		if (sim->fromModule.time[(sim->fromModule.head + i) % 512] > now)
+			break;
+		n++;
+	}
+	return n;
+}
+
+int SM130Sim::Port::read()
+{
+	return available() ? pop(sim->fromModule, true) : -1;
+}
+
+int SM130Sim::Port::peek()
+{
+	return available() ? pop(sim->fromModule, false) : -1;
+}
+
+size_t SM130Sim::Port::write(uint8_t b)
+{
+	// bytes at a mismatched baud rate arrive garbled
+	if (sim->hostBaud != sim->moduleBaud)
+		b ^= 0x5a;
+	uint64_t start = max(host::now(), sim->toModule.last);
+	push(sim->toModule, start + sim->byteTime(sim->hostBaud), b);
+	return 1;
+}
+
+void SM130Sim::push(Line& line, uint64_t time, uint8_t b)
+{
+	if (line.count == 512)
+		return; // overrun
+	uint16_t i = (line.head + line.count++) % 512;
+	line.time[i] = time;
+	line.data[i] = b;
+	line.last = time;
+}
+
+int SM130Sim::pop(Line& line, bool remove)
+{
+	if (line.count == 0)
+		return -1;
+	uint8_t b = line.data[line.head];
+	if (remove)
+	{
+		line.head = (line.head + 1) % 512;
+		line.count--;
+	}
+	return b;
+}
+
+/**	Parse frames: header 0xFF, reserved 0x00, length, command, data, checksum.
+ */
+void SM130Sim::uartByte(uint8_t b)
+{
+	if (frameIndex == 0)
+	{
+		if (b == 0xff)
+			frame[frameIndex++] = b;
+		return;
+	}
+	if (frameIndex == 1 && b != 0x00)
+	{
+		frameIndex = b == 0xff ? 1 : 0;
+		return;
+	}
+	if (frameIndex == 2 && (b == 0 || b > 20))
+	{
+		frameIndex = 0;
+		return;
+	}
+	frame[frameIndex++] = b;
+	if (frameIndex < 4 + frame[2])
+		return;
+
+	// checksum of all bytes except the header
+	uint8_t sum = 0;
+	for (uint8_t i = 1; i < frameIndex - 1; i++)
+		sum += frame[i];
+	if (sum == frame[frameIndex - 1])
+		execute(frame + 3, frame[2], true);
+	frameIndex = 0;
+}
+
+/* Module *********************************************************************/
+
+void SM130Sim::reset()
+{
+	selected = -1;
+	authSector = 0xff;
+	seeking = false;
+	asleep = false;
+	antenna = 1;
+	portValue = 0;
+	responseScheduled = false;
+	i2cReady = false;
+	if (pinDREADY != 0xff)
+		host::setPin(pinDREADY, LOW);
+}
+
+int SM130Sim::tagInField()
+{
+	for (uint8_t i = 0; i < tagCount; i++)
+	{
+		if (tags[i].inField)
+			return i;
+	}
+	return -1;
+}
+
+uint16_t SM130Sim::blockCount(int tag)
+{
+	switch (tags[tag].type)
+	{
+	case MIFARE_ULTRALIGHT: return 4; // 16 pages
+	case MIFARE_4K: return 256;
+	default: return 64;
+	}
+}
+
+bool SM130Sim::checkKey(uint8_t block, uint8_t keyType, const uint8_t* key)
+{
+	const uint8_t* trailer = tags[selected].memory + 16 * trailerOf(sectorOf(block));
+	static const uint8_t transport[6] = { 0xff, 0xff, 0xff, 0xff, 0xff, 0xff };
+
+	if (keyType == 0xff)
+		return memcmp(trailer, transport, 6) == 0;
+	if (keyType == 0xaa)
+		return memcmp(trailer, key, 6) == 0;
+	if (keyType == 0xbb)
+		return memcmp(trailer + 10, key, 6) == 0;
+	if (keyType >= 0x10 && keyType <= 0x1f)
+		return memcmp(trailer, keys[keyType - 0x10], 6) == 0;
+	if (keyType >= 0x20 && keyType <= 0x2f)
+		return memcmp(trailer + 10, keys[keyType - 0x20], 6) == 0;
+	return false;
+}
+
+bool SM130Sim::readValue(uint8_t block, int32_t* value)
+{
+	const uint8_t* b = tags[selected].memory + 16 * block;
+	for (uint8_t i = 0; i < 4; i++)
+	{
+		if (b[i] != b[i + 8] || b[i] != (uint8_t)~b[i + 4])
+			return false;
+	}
+	if (b[12] != b[14] || b[13] != b[15] || b[12] != (uint8_t)~b[13])
+		return false;
+	*value = (int32_t)((uint32_t)b[0] | (uint32_t)b[1] << 8 | (uint32_t)b[2] << 16 | (uint32_t)b[3] << 24);
+	return true;
+}
+
+void SM130Sim::writeValue(uint8_t block, int32_t value)
+{
+	uint8_t* b = tags[selected].memory + 16 * block;
+	for (uint8_t i = 0; i < 4; i++)
+	{
+		b[i] = b[i + 8] = (uint8_t)(value >> (8 * i));
+		b[i + 4] = ~b[i];
+	}
+	b[12] = b[14] = block;
+	b[13] = b[15] = ~block;
+}
+
+/**	Execute a command.
+ *
+ *	@param command Command code followed by the command data
+ *	@param length Length of command code and data
+ *	@param uart true if the command arrived over UART
+ */
+void SM130Sim::execute(const uint8_t* command, uint8_t length, bool uart)
+{
+	uint8_t cmd = command[0];
+	const uint8_t* arg = command + 1;
+	uint8_t argLength = length - 1;
+	uint8_t payload[18];
+
+	if (asleep)
+		return;
+
+	commands++;
+	responseUart = uart;
+
+	// any command ends seek mode and replaces the response being processed
+	seeking = false;
+	responseScheduled = false;
+	i2cReady = false;
+	if (pinDREADY != 0xff)
+		host::setPin(pinDREADY, LOW);
+
+	bool classic = selected >= 0 && tags[selected].type != MIFARE_ULTRALIGHT;
+	uint8_t block = argLength > 0 ? arg[0] : 0;
+	bool inRange = selected >= 0 && (tags[selected].type == MIFARE_ULTRALIGHT ? block < 16 : block < blockCount(selected));
+	int32_t value;
+
+	switch (cmd)
+	{
+	case CMD_RESET:
+		reset();
+		respond(cmd, (const uint8_t*)version, strlen(version), getLatency(cmd));
+		break;
+
+	case CMD_VERSION:
+		respond(cmd, (const uint8_t*)version, strlen(version), getLatency(cmd));
+		break;
+
+	case CMD_SEEK_TAG:
+	case CMD_SELECT_TAG:
+		selected = -1;
+		authSector = 0xff;
+		if (!antenna)
+		{
+			respondStatus(cmd, 'U');
+		}
+		else if (tagInField() >= 0)
+		{
+			selected = tagInField();
+			payload[0] = tags[selected].type;
+			memcpy(payload + 1, tags[selected].uid, tags[selected].uidLength);
+			respond(cmd, payload, tags[selected].uidLength + 1, getLatency(cmd));
+		}
+		else if (cmd == CMD_SEEK_TAG)
+		{
+			respond(cmd, (const uint8_t*)"L", 1, getLatency(CMD_VERSION));
+			seeking = true;
+		}
+		else
+		{
+			respondStatus(cmd, 'N');
+		}
+		break;
+
+	case CMD_AUTHENTICATE:
+		if (!classic || !inRange || argLength < 2 || ((arg[1] == 0xaa || arg[1] == 0xbb) && argLength < 8))
+		{
+			respondStatus(cmd, 'N');
+		}
+		else if (checkKey(block, arg[1], arg + 2))
+		{
+			authSector = sectorOf(block);
+			respondStatus(cmd, 'L');
+		}
+		else
+		{
+			// the tag must be selected again after a failed login
+			authSector = 0xff;
+			selected = -1;
+			respondStatus(cmd, 'U');
+		}
+		break;
+
+	case CMD_READ16:
+		if (selected < 0)
+		{
+			respondStatus(cmd, 'N');
+		}
+		else if (!inRange || (classic && sectorOf(block) != authSector))
+		{
+			respondStatus(cmd, 'F');
+		}
+		else
+		{
+			payload[0] = block;
+			if (classic)
+			{
+				memcpy(payload + 1, tags[selected].memory + 16 * block, 16);
+				// key A is never readable
+				if (trailerOf(sectorOf(block)) == block)
+					memset(payload + 1, 0, 6);
+			}
+			else
+			{
+				// four consecutive pages, wrapping around
+				for (uint8_t i = 0; i < 16; i++)
+					payload[1 + i] = tags[selected].memory[(4 * block + i) % 64];
+			}
+			respond(cmd, payload, 17, getLatency(cmd));
+		}
+		break;
+
+	case CMD_READ_VALUE:
+	case CMD_INC_VALUE:
+	case CMD_DEC_VALUE:
+		if (selected < 0)
+		{
+			respondStatus(cmd, 'N');
+		}
+		else if (!classic || !inRange || sectorOf(block) != authSector)
+		{
+			respondStatus(cmd, 'F');
+		}
+		else if (!readValue(block, &value) || (cmd != CMD_READ_VALUE && argLength < 5))
+		{
+			respondStatus(cmd, 'I');
+		}
+		else
+		{
+			if (cmd != CMD_READ_VALUE)
+			{
+				int32_t delta = (int32_t)((uint32_t)arg[1] | (uint32_t)arg[2] << 8 | (uint32_t)arg[3] << 16 | (uint32_t)arg[4] << 24);
+				value = cmd == CMD_INC_VALUE ? value + delta : value - delta;
+				writeValue(block, value);
+			}
+			payload[0] = block;
+			for (uint8_t i = 0; i < 4; i++)
+				payload[1 + i] = (uint8_t)(value >> (8 * i));
+			respond(cmd, payload, 5, getLatency(cmd));
+		}
+		break;
+
+	case CMD_WRITE16:
+	case CMD_WRITE_VALUE:
+		if (selected < 0)
+		{
+			respondStatus(cmd, 'N');
+		}
+		else if (!inRange || block == 0 || argLength < (cmd == CMD_WRITE16 ? 17 : 5)
+			|| (classic && sectorOf(block) != authSector) || (!classic && cmd == CMD_WRITE_VALUE))
+		{
+			respondStatus(cmd, 'F');
+		}
+		else if (cmd == CMD_WRITE16)
+		{
+			// Ultralight compatibility write only stores the first page
+			memcpy(classic ? tags[selected].memory + 16 * block : tags[selected].memory + 4 * block, arg + 1, classic ? 16 : 4);
+			respond(cmd, arg, 17, getLatency(cmd));
+		}
+		else
+		{
+			value = (int32_t)((uint32_t)arg[1] | (uint32_t)arg[2] << 8 | (uint32_t)arg[3] << 16 | (uint32_t)arg[4] << 24);
+			writeValue(block, value);
+			respond(cmd, arg, 5, getLatency(cmd));
+		}
+		break;
+
+	case CMD_WRITE4:
+		if (selected < 0)
+		{
+			respondStatus(cmd, 'N');
+		}
+		else if (classic || !inRange || block < 2 || argLength < 5)
+		{
+			respondStatus(cmd, 'F');
+		}
+		else
+		{
+			memcpy(tags[selected].memory + 4 * block, arg + 1, 4);
+			respond(cmd, arg, 5, getLatency(cmd));
+		}
+		break;
+
+	case CMD_WRITE_KEY:
+		if (argLength < 7 || arg[0] > 15)
+		{
+			respondStatus(cmd, 'N');
+		}
+		else
+		{
+			memcpy(keys[arg[0]], arg + 1, 6);
+			respondStatus(cmd, 'L');
+		}
+		break;
+
+	case CMD_ANTENNA_POWER:
+		antenna = argLength > 0 ? arg[0] : 1;
+		if (!antenna)
+		{
+			selected = -1;
+			authSector = 0xff;
+		}
+		respondStatus(cmd, antenna);
+		break;
+
+	case CMD_READ_PORT:
+		respondStatus(cmd, portValue);
+		break;
+
+	case CMD_WRITE_PORT:
+		portValue = argLength > 0 ? arg[0] & 0x03 : 0;
+		respondStatus(cmd, portValue);
+		break;
+
+	case CMD_HALT_TAG:
+		selected = -1;
+		authSector = 0xff;
+		respondStatus(cmd, antenna ? 'L' : 'U');
+		break;
+
+	case CMD_SET_BAUD:
+		if (argLength < 1 || arg[0] >= sizeof(baudRates) / sizeof(baudRates[0]))
+		{
+			respondStatus(cmd, 'N');
+		}
+		else
+		{
+			// the response is sent at the old rate
+			nextBaud = baudRates[arg[0]];
+			respondStatus(cmd, 'L');
+		}
+		break;
+
+	case CMD_SLEEP:
+		asleep = true;
+		break;
+	}
+}
+
+/**	Schedule a response.
+ *
+ *	@param cmd Command code
+ *	@param payload Response data
+ *	@param length Length of response data
+ *	@param us Processing time
+ */
+void SM130Sim::respond(uint8_t cmd, const uint8_t* payload, uint8_t length, unsigned long us)
+{
+	if (jitter)
+	{
+		random = random * 1103515245 + 12345;
+		us += (random >> 8) % (jitter + 1);
+	}
+	response[0] = length + 1;
+	response[1] = cmd;
+	memcpy(response + 2, payload, length);
+	responseScheduled = true;
+	responseTime = clock + us;
+}
+
+/**	Send the scheduled response over I2C or UART, injecting faults.
+ */
+void SM130Sim::deliver()
+{
+	responseScheduled = false;
+
+	uint8_t length = response[0] + 1;
+	bool fault[FAULT_COUNT];
+	for (uint8_t f = 0; f < FAULT_COUNT; f++)
+	{
+		fault[f] = faultEvery[f] > 0 && (faultCommand == 0 || response[1] == faultCommand) &&
+			++faultCount[f] % faultEvery[f] == 0;
+		if (fault[f])
+			faults++;
+	}
+	if (fault[FAULT_DROP])
+		return;
+	if (fault[FAULT_WRONG_COMMAND])
+		response[1] ^= 0x01;
+	if (fault[FAULT_DATA] && length > 2)
+		response[length - 1] ^= 0x01;
+
+	uint8_t sum = 0;
+	for (uint8_t i = 0; i < length; i++)
+		sum += response[i];
+	if (fault[FAULT_CHECKSUM])
+		sum++;
+	responses++;
+
+	if (responseUart)
+	{
+		uint64_t time = max(responseTime, fromModule.last);
+		uint8_t garble = hostBaud != moduleBaud ? 0x5a : 0;
+		push(fromModule, time += byteTime(moduleBaud), 0xff ^ garble);
+		push(fromModule, time += byteTime(moduleBaud), 0x00 ^ garble);
+		for (uint8_t i = 0; i < length; i++)
+			push(fromModule, time += byteTime(moduleBaud), response[i] ^ garble);
+		push(fromModule, time += byteTime(moduleBaud), sum ^ garble);
+		moduleBaud = nextBaud;
+	}
+	else
+	{
+		memcpy(i2cBuffer, response, length);
+		i2cBuffer[length] = sum;
+		i2cReady = true;
+		if (pinDREADY != 0xff)
+			host::setPin(pinDREADY, HIGH);
+	}
+}
@@ -0,0 +1,172 @@
+/**
+ * 	@file	sm130sim.h
+ * 	@brief	SonMicro SM130 simulator for the host build
+ *
+ *	<p>
+ *	Implements the SM130 command set of the datasheet over I2C (attach to
+ *	the emulated Wire bus, with optional DREADY and RESET pins) and over
+ *	UART (serial(), a HardwareSerial with byte timing at the baud rate).
+ *	Tags with Mifare Ultralight, 1K or 4K memory layout can be moved in and
+ *	out of the field. Per-command processing latency, latency jitter and
+ *	periodic faults are configurable.
+ *	</p>
+ */
+
+#ifndef SM130SIM_h
+#define SM130SIM_h
+
+#include "Arduino.h"
+
+/**	Simulated SM130 RFID module.
+ */
+class SM130Sim : public host::Device
+{
+public:
+	static const uint8_t MAX_TAGS = 8; //!< maximum number of tags
+	static const uint8_t MIFARE_ULTRALIGHT = 1;
+	static const uint8_t MIFARE_1K = 2;
+	static const uint8_t MIFARE_4K = 3;
+
+	//! Faults that can be injected in responses
+	enum Fault
+	{
+		FAULT_CHECKSUM, //!< response with wrong checksum
+		FAULT_DROP, //!< response is never sent
+		FAULT_WRONG_COMMAND, //!< response with another command code
+		FAULT_DATA, //!< response with its last data byte changed, and a valid checksum
+		FAULT_COUNT
+	};
+
+	/**	Host side of the UART link.
+	 */
+	class Port : public HardwareSerial
+	{
+		SM130Sim* sim;
+	public:
+		Port(SM130Sim* sim) : sim(sim) {}
+		virtual void begin(unsigned long baud);
+		virtual int available();
+		virtual int read();
+		virtual int peek();
+		virtual size_t write(uint8_t b);
+		virtual int availableForWrite() { return 64; }
+		using Print::write;
+	};
+
+	unsigned long commands; //!< number of valid commands received
+	unsigned long responses; //!< number of responses sent
+	unsigned long faults; //!< number of faults injected
+
+	SM130Sim();
+	//! Connect to the I2C bus, and optionally to the DREADY and RESET pins
+	void attachI2C(uint8_t address = 0x42, uint8_t pinDREADY = 0xff, uint8_t pinRESET = 0xff);
+	//! Returns the host side of the UART link
+	HardwareSerial& serial() { return port; };
+	//! Returns the module's current baud rate
+	unsigned long getBaudRate() { return moduleBaud; };
+	//! Set the firmware version string
+	void setVersion(const char* version);
+	//! Add a tag with transport keys, returns its index or -1
+	int addTag(uint8_t type, const uint8_t* uid, uint8_t uidLength);
+	//! Move a tag in or out of the field
+	void setInField(int tag, bool inField);
+	//! Returns a pointer to a 16-byte block of tag memory (4-byte pages for Ultralight start at 4*page)
+	uint8_t* block(int tag, uint8_t block);
+	//! Set the processing latency of a command in microseconds
+	void setLatency(uint8_t cmd, unsigned long us);
+	//! Returns the processing latency of a command in microseconds
+	unsigned long getLatency(uint8_t cmd);
+	//! Set the maximum random latency added to each command in microseconds
+	void setJitter(unsigned long us) { jitter = us; };
+	//! Inject a fault in every nth response, 0 to disable
+	void setFaultEvery(Fault fault, unsigned long n);
+	//! Inject faults only in responses to a command, 0 for all commands
+	void setFaultCommand(uint8_t cmd) { faultCommand = cmd; };
+
+	virtual void tick(uint64_t now);
+	virtual void pinWritten(uint8_t pin, uint8_t level);
+	virtual void i2cReceive(const uint8_t* buffer, size_t length);
+	virtual size_t i2cRequest(uint8_t* buffer, size_t length);
+
+private:
+	struct Tag
+	{
+		uint8_t type;
+		uint8_t uid[7];
+		uint8_t uidLength;
+		bool inField;
+		uint8_t memory[4096];
+	};
+
+	struct Line
+	{
+		uint64_t time[512];
+		uint8_t data[512];
+		uint16_t head;
+		uint16_t count;
+		uint64_t last;
+	};
+
+	Port port;
+	Tag tags[MAX_TAGS];
+	uint8_t tagCount;
+	char version[16];
+	unsigned long latency[0x17];
+	unsigned long jitter;
+	unsigned long faultEvery[FAULT_COUNT];
+	unsigned long faultCount[FAULT_COUNT];
+	uint8_t faultCommand;
+	uint32_t random;
+
+	// module state
+	int selected;
+	uint8_t authSector;
+	bool seeking;
+	bool asleep;
+	uint8_t antenna;
+	uint8_t portValue;
+	uint8_t keys[16][6];
+
+	// I2C
+	uint8_t address;
+	uint8_t pinDREADY;
+	uint8_t pinRESET;
+	uint8_t pinResetLevel;
+	uint8_t i2cBuffer[20];
+	bool i2cReady;
+
+	// response being processed
+	uint8_t response[20];
+	bool responseScheduled;
+	bool responseUart;
+	uint64_t responseTime;
+
+	// UART
+	unsigned long moduleBaud;
+	unsigned long hostBaud;
+	unsigned long nextBaud;
+	Line toModule;
+	Line fromModule;
+	uint8_t frame[24];
+	uint8_t frameIndex;
+	uint64_t clock; //!< time of the event being processed
+
+	void reset();
+	void execute(const uint8_t* command, uint8_t length, bool uart);
+	void respond(uint8_t cmd, const uint8_t* payload, uint8_t length, unsigned long us);
+	void respondStatus(uint8_t cmd, uint8_t status) { respond(cmd, &status, 1, getLatency(cmd)); };
+	void deliver();
+	void uartByte(uint8_t b);
+	int tagInField();
+	uint16_t blockCount(int tag);
+	bool checkKey(uint8_t block, uint8_t keyType, const uint8_t* key);
+	bool readValue(uint8_t block, int32_t* value);
+	void writeValue(uint8_t block, int32_t value);
+	unsigned long byteTime(unsigned long baud) { return 10000000UL / baud; };
+	static void push(Line& line, uint64_t time, uint8_t b);
+	static int pop(Line& line, bool remove);
+	static uint8_t sectorOf(uint8_t block) { return block < 128 ? block / 4 : 32 + (block - 128) / 16; };
+	static uint8_t trailerOf(uint8_t sector) { return sector < 32 ? sector * 4 + 3 : 128 + (sector - 32) * 16 + 15; };
+};
+
+#endif // SM130SIM_h
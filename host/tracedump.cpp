@@ -0,0 +1,83 @@
+/**
+ * 	@file	tracedump.cpp
+ * 	@brief	Decoder of the SM130 debug trace, see sm130common/sm130trace.h
+ *
+ *	<p>
+ *	Reads the binary trace drained from SM130Trace, e.g. a capture of the
+ *	Arduino's serial port, and prints one line per packet in the format of
+ *	the SM130 debug mode, prefixed with the timestamp in microseconds:
+ *	</p>
+ *	<pre>
+ *	    1234567 > 01 82 83
+ *	    1256789 < 02 82 4C D0
+ *	</pre>
+ *	<p>
+ *	Bytes outside of records, like text printed by the sketch, are skipped.
+ *	Usage: tracedump [-n] [file], reads standard input if no file is given,
+ *	-n omits the timestamps.
+ *	</p>
+ *	<p>
+ *	Build: g++ -DARDUINO=10800 -Ihost -Ism130common host/tracedump.cpp -o tracedump
+ *	</p>
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "Arduino.h"
+#include "sm130trace.h"
+
+static bool readBytes(FILE* in, byte* buffer, int length)
+{
+	return fread(buffer, 1, length, in) == (size_t)length;
+}
+
+int main(int argc, char* argv[])
+{
+	bool timestamps = true;
+	FILE* in = stdin;
+
+	for (int i = 1; i < argc; i++)
+	{
+		if (strcmp(argv[i], "-n") == 0)
+			timestamps = false;
+		else if ((in = fopen(argv[i], "rb")) == 0)
+		{
+			perror(argv[i]);
+			return 1;
+		}
+	}
+
+	int c;
+	while ((c = fgetc(in)) != EOF)
+	{
+		// skip anything but a record header
+		if ((c & SM130_TRACE_HEADER) != SM130_TRACE_HEADER)
+			continue;
+
+		byte stamp[4];
+		byte packet[SM130_TRACE_LENGTH];
+		int length = c & SM130_TRACE_LENGTH;
+		if (!readBytes(in, stamp, 4) || !readBytes(in, packet, length))
+			break;
+		uint32_t value = stamp[0] | stamp[1] << 8 | stamp[2] << 16 | (uint32_t)stamp[3] << 24;
+
+		// a record without direction and length reports discarded records
+		if ((c & ~SM130_TRACE_HEADER) == 0)
+		{
+			printf("-- %lu records discarded\n", (unsigned long)value);
+			continue;
+		}
+
+		if (timestamps)
+			printf("%10lu ", (unsigned long)value);
+		printf("%c", c & SM130_TRACE_RECEIVED ? '<' : '>');
+		for (int i = 0; i < length; i++)
+			printf(" %02X", packet[i]);
+		printf("\n");
+	}
+
+	if (in != stdin)
+		fclose(in);
+	return 0;
+}
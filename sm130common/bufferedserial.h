@@ -0,0 +1,167 @@
+/**
+ * 	@file	bufferedserial.h
+ * 	@brief	Serial port with sized receive and transmit ring buffers
+ *
+ *	<p>
+ *	The core's HardwareSerial receives and transmits by interrupt through
+ *	small fixed buffers, drops received bytes silently when its buffer is
+ *	full, and blocks write() when its transmit buffer is full. BufferedSerial
+ *	adds rings of any size on top of it, moves bytes between the port and
+ *	the rings whenever it is used, and never blocks on write(). It is a
+ *	Stream, so it can be passed to NFCReader::setSerial() or
+ *	XBee::setSerial(). The class is final, so an NFCReaderT<BufferedSerial>
+ *	reads it without virtual calls.
+ *	</p>
+ *	<p>
+ *	The receive ring is only filled when the port is polled: between polls,
+ *	bytes still arrive in the core's buffer (SERIAL_RX_BUFFER_SIZE, 64 bytes
+ *	on AVR), and the core drops them unseen when it fills up. rxOverflows
+ *	only counts bytes dropped because the receive ring was full. rxPortFull
+ *	counts the polls that found the core's buffer full, the only trace of
+ *	such a loss. Call service() from loop() often enough to drain the core's
+ *	buffer at the line rate, or build with a larger SERIAL_RX_BUFFER_SIZE
+ *	where the core allows it.
+ *	</p>
+ */
+
+#ifndef BUFFEREDSERIAL_h
+#define BUFFEREDSERIAL_h
+
+#if defined(ARDUINO) && ARDUINO >= 100
+#include "Arduino.h"
+#else
+#include "WProgram.h"
+#endif
+
+#ifndef SERIAL_RX_BUFFER_SIZE
+#define SERIAL_RX_BUFFER_SIZE 64 // receive buffer of the core's HardwareSerial
+#endif
+
+/**	Ring-buffered serial port.
+ */
+class BufferedSerial final : public Stream
+{
+	/**	Ring buffer in caller-supplied storage.
+	 */
+	struct Ring
+	{
+		byte* buffer;
+		size_t size;
+		size_t head; //!< index of the oldest byte
+		size_t count; //!< number of bytes in the ring
+
+		void init(byte* b, size_t s) { buffer = b; size = s; head = count = 0; };
+		boolean full() const { return count == size; };
+		void put(byte b) { buffer[(head + count++) % size] = b; };
+		byte get() { byte b = buffer[head]; head = (head + 1) % size; count--; return b; };
+	};
+
+	HardwareSerial* port; //!< underlying serial port
+	Ring rx; //!< bytes received from the port, not yet read
+	Ring tx; //!< bytes written, not yet passed to the port
+
+public:
+	uint32_t rxOverflows; //!< received bytes dropped because the receive ring was full
+	uint32_t rxPortFull; //!< polls that found the core's receive buffer full, so it may have dropped bytes
+	uint32_t txOverflows; //!< written bytes dropped because the transmit ring was full
+
+	/**	Constructor.
+	 *
+	 *	@param port Serial port, e.g. Serial1
+	 *	@param rxBuffer Storage of the receive ring
+	 *	@param rxSize Size of the receive ring
+	 *	@param txBuffer Storage of the transmit ring
+	 *	@param txSize Size of the transmit ring
+	 */
+	BufferedSerial(HardwareSerial& port, byte* rxBuffer, size_t rxSize, byte* txBuffer, size_t txSize) : port(&port)
+	{
+		rx.init(rxBuffer, rxSize);
+		tx.init(txBuffer, txSize);
+		rxOverflows = rxPortFull = txOverflows = 0;
+	};
+
+	//! Open the port, or change its baud rate after transmitting pending bytes
+	void begin(unsigned long baud)
+	{
+		flush();
+		port->begin(baud);
+	};
+
+	//! Move received bytes into the receive ring, and pending bytes to the port as far as it accepts them without blocking
+	void service()
+	{
+		// the core's ring holds one byte less than its size
+		if (port->available() >= SERIAL_RX_BUFFER_SIZE - 1)
+			rxPortFull++;
+		while (port->available() > 0)
+		{
+			byte b = port->read();
+			if (rx.full())
+				rxOverflows++;
+			else
+				rx.put(b);
+		}
+		while (tx.count > 0 && port->availableForWrite() > 0)
+			port->write(tx.get());
+	};
+
+	virtual int available()
+	{
+		service();
+		return rx.count;
+	};
+
+	virtual int read()
+	{
+		service();
+		return rx.count > 0 ? rx.get() : -1;
+	};
+
+	virtual int peek()
+	{
+		service();
+		return rx.count > 0 ? rx.buffer[rx.head] : -1;
+	};
+
+	/**	Queue a byte for transmission.
+	 *
+	 *	A byte that doesn't fit is dropped: write() returns 0 and txOverflows
+	 *	counts it. Writers of frames should check availableForWrite() for the
+	 *	whole frame first, as XBeeTxQueue does, so a frame is never cut short.
+	 *
+	 *	@return 1, or 0 if the transmit ring is full
+	 */
+	virtual size_t write(uint8_t b)
+	{
+		if (tx.full())
+			service();
+		if (tx.full())
+		{
+			txOverflows++;
+			return 0;
+		}
+		tx.put(b);
+		service();
+		return 1;
+	};
+	using Print::write;
+
+	virtual int availableForWrite()
+	{
+		service();
+		return tx.size - tx.count;
+	};
+
+	//! Wait until all written bytes are transmitted
+	virtual void flush()
+	{
+		while (tx.count > 0)
+			service();
+		port->flush();
+	};
+
+	//! Clear the overflow counters
+	void resetCounters() { rxOverflows = rxPortFull = txOverflows = 0; };
+};
+
+#endif // BUFFEREDSERIAL_h
@@ -0,0 +1,811 @@
+/**
+ * 	@file	sm130core.h
+ * 	@brief	SM130 protocol core shared by the I2C and UART drivers
+ *
+ *	<p>
+ *	Both transports carry the same packet, length(1) command(1) data(n)
+ *	checksum(1), where length counts the command and data bytes, and the
+ *	checksum is the sum of the length, command and data bytes. The UART
+ *	transport prefixes it with the header 0xFF 0x00. This file holds what
+ *	doesn't depend on the transport: command codes, the command descriptor
+ *	table, Mifare memory layout and value encoding, and frame building,
+ *	verification and parsing templated on the framing, so neither driver
+ *	goes through a virtual call per byte.
+ *	</p>
+ *	<p>
+ *	It also holds the protocol logic built on single commands: the
+ *	authenticated session, block reads and writes, value transactions,
+ *	write batches and card dumps. SM130Operations runs them on any driver that can send a command
+ *	and wait for its response, so both drivers are thin transports.
+ *	</p>
+ */
+
+#ifndef SM130CORE_h
+#define SM130CORE_h
+
+#if defined(ARDUINO) && ARDUINO >= 100
+#include "Arduino.h"
+#else
+#include "WProgram.h"
+#endif
+
+#define SM130_MAX_DATA 17 // maximum number of data bytes in a packet, after the command byte
+#define SM130_TIMEOUT 100 // time-out (ms) for a response
+#define SM130_TIMEOUT_WRITE 200 // time-out (ms) for the response to a write command
+#define SM130_TIMEOUT_RESET 500 // time-out (ms) for the response to a reset
+#define SM130_MAX_RETRIES 2 // maximum number of times a command is sent again
+
+// How a driver processes the response to a command
+enum
+{
+	SM130_PARSE_NONE, //!< nothing to do
+	SM130_PARSE_VERSION, //!< firmware version string
+	SM130_PARSE_TAG, //!< tag type and tag number
+	SM130_PARSE_ANTENNA //!< antenna power level
+};
+
+/**	Describes the response to a command.
+ */
+struct SM130CommandInfo
+{
+	byte maxData; //!< maximum number of data bytes in the response, after the command byte
+	boolean canFail; //!< true if the command can respond with only an error code
+	byte parser; //!< how to process the response (SM130_PARSE_XX)
+	boolean retry; //!< true if the command may be sent again after a checksum error or time-out
+	uint16_t timeout; //!< time-out (ms) for the response
+};
+
+#define SM130_ANY_BALANCE ((int32_t)0x80000000) // expected balance that skips the balance check of a value transaction
+
+// Results of the blocking operations, besides error codes of the failed command
+#define SM130_DONE 0x01 // the command succeeded
+#define SM130_NO_RESPONSE 0xff // the command got no response, or could not be sent
+#define SM130_UNVERIFIED 'V' // the response to a write doesn't echo the block and data written
+
+// Results of value transactions (debit and credit), besides error codes of the failed command
+enum
+{
+	SM130_VALUE_DONE = 0x01, //!< the value was changed, and verified if a balance was expected
+	SM130_VALUE_MISMATCH = 'M', //!< the balance is not the expected one, nothing was changed
+	SM130_VALUE_UNVERIFIED = SM130_UNVERIFIED //!< the value read back after the change is not the expected one
+};
+
+/**	Receives the blocks of a card dump.
+ *
+ *	@param block Block number, or first page of four for Mifare Ultralight
+ *	@param data Block data (16 bytes), valid until the function returns
+ *	@return true to continue the dump, false to stop it
+ */
+typedef boolean (*SM130DumpSink)(byte block, const byte* data);
+
+/**	Command codes, command descriptors and Mifare memory layout.
+ */
+struct SM130Protocol
+{
+	static constexpr byte CMD_RESET = 0x80;
+	static constexpr byte CMD_VERSION = 0x81;
+	static constexpr byte CMD_SEEK_TAG = 0x82;
+	static constexpr byte CMD_SELECT_TAG = 0x83;
+	static constexpr byte CMD_AUTHENTICATE = 0x85;
+	static constexpr byte CMD_READ16 = 0x86;
+	static constexpr byte CMD_READ_VALUE = 0x87;
+	static constexpr byte CMD_WRITE16 = 0x89;
+	static constexpr byte CMD_WRITE_VALUE = 0x8a;
+	static constexpr byte CMD_WRITE4 = 0x8b;
+	static constexpr byte CMD_WRITE_KEY = 0x8c;
+	static constexpr byte CMD_INC_VALUE = 0x8d;
+	static constexpr byte CMD_DEC_VALUE = 0x8e;
+	static constexpr byte CMD_ANTENNA_POWER = 0x90;
+	static constexpr byte CMD_READ_PORT = 0x91;
+	static constexpr byte CMD_WRITE_PORT = 0x92;
+	static constexpr byte CMD_HALT_TAG = 0x93;
+	static constexpr byte CMD_SET_BAUD = 0x94;
+	static constexpr byte CMD_SLEEP = 0x96;
+
+	static constexpr byte MIFARE_ULTRALIGHT = 1;
+	static constexpr byte MIFARE_1K = 2;
+	static constexpr byte MIFARE_4K = 3;
+
+	/**	Get the descriptor of a command.
+	 *
+	 *	Unused command codes read a full packet.
+	 *
+	 *	@param	cmd	Command
+	 *	@param	info	Destination for the descriptor
+	 */
+	static void getCommandInfo(byte cmd, SM130CommandInfo* info)
+	{
+		static constexpr SM130CommandInfo table[] PROGMEM =
+		{
+			{ SM130_MAX_DATA, false, SM130_PARSE_VERSION, false, SM130_TIMEOUT_RESET }, // CMD_RESET: firmware version
+			{ SM130_MAX_DATA, false, SM130_PARSE_VERSION, true, SM130_TIMEOUT }, // CMD_VERSION: firmware version
+			{ 8, true, SM130_PARSE_TAG, true, SM130_TIMEOUT }, // CMD_SEEK_TAG: tag type + 7-byte tag number
+			{ 8, true, SM130_PARSE_TAG, true, SM130_TIMEOUT }, // CMD_SELECT_TAG: tag type + 7-byte tag number
+			{ SM130_MAX_DATA, true, SM130_PARSE_NONE, false, SM130_TIMEOUT }, // 0x84
+			{ 1, true, SM130_PARSE_NONE, true, SM130_TIMEOUT }, // CMD_AUTHENTICATE: status only
+			{ 17, true, SM130_PARSE_NONE, true, SM130_TIMEOUT }, // CMD_READ16: block number + 16 bytes
+			{ 5, true, SM130_PARSE_NONE, true, SM130_TIMEOUT }, // CMD_READ_VALUE: block number + 4-byte value
+			{ SM130_MAX_DATA, true, SM130_PARSE_NONE, false, SM130_TIMEOUT }, // 0x88
+			{ 17, true, SM130_PARSE_NONE, true, SM130_TIMEOUT_WRITE }, // CMD_WRITE16: block number + 16 bytes
+			{ 5, true, SM130_PARSE_NONE, true, SM130_TIMEOUT_WRITE }, // CMD_WRITE_VALUE: block number + 4-byte value
+			{ 5, true, SM130_PARSE_NONE, true, SM130_TIMEOUT_WRITE }, // CMD_WRITE4: block number + 4 bytes
+			{ 1, true, SM130_PARSE_NONE, true, SM130_TIMEOUT_WRITE }, // CMD_WRITE_KEY: status only
+			{ 5, true, SM130_PARSE_NONE, false, SM130_TIMEOUT_WRITE }, // CMD_INC_VALUE: block number + 4-byte value
+			{ 5, true, SM130_PARSE_NONE, false, SM130_TIMEOUT_WRITE }, // CMD_DEC_VALUE: block number + 4-byte value
+			{ SM130_MAX_DATA, true, SM130_PARSE_NONE, false, SM130_TIMEOUT }, // 0x8f
+			{ 1, false, SM130_PARSE_ANTENNA, true, SM130_TIMEOUT }, // CMD_ANTENNA_POWER: power level
+			{ 1, false, SM130_PARSE_NONE, true, SM130_TIMEOUT }, // CMD_READ_PORT: port value
+			{ 1, false, SM130_PARSE_NONE, true, SM130_TIMEOUT }, // CMD_WRITE_PORT: port value
+			{ 1, true, SM130_PARSE_NONE, true, SM130_TIMEOUT }, // CMD_HALT_TAG: status only
+			{ 1, true, SM130_PARSE_NONE, false, SM130_TIMEOUT }, // CMD_SET_BAUD: status only
+			{ SM130_MAX_DATA, true, SM130_PARSE_NONE, false, SM130_TIMEOUT }, // 0x95
+			{ 1, true, SM130_PARSE_NONE, false, SM130_TIMEOUT }, // CMD_SLEEP: no response
+		};
+		static_assert(sizeof(table) / sizeof(table[0]) == CMD_SLEEP - CMD_RESET + 1,
+			"table must have an entry for each command code");
+		static_assert(table[CMD_READ16 - CMD_RESET].maxData <= SM130_MAX_DATA,
+			"READ16 response must fit in a packet");
+
+		static const SM130CommandInfo unknown = { SM130_MAX_DATA, true, SM130_PARSE_NONE, false, SM130_TIMEOUT };
+		if (cmd >= CMD_RESET && cmd <= CMD_SLEEP)
+			memcpy_P(info, &table[cmd - CMD_RESET], sizeof(SM130CommandInfo));
+		else
+			*info = unknown;
+	};
+
+	//! Returns the sector containing a block (Mifare 1K/4K)
+	static constexpr byte sectorOf(byte block) { return block < 128 ? block / 4 : 32 + (block - 128) / 16; };
+	//! Returns the first block of a sector (Mifare 1K/4K)
+	static constexpr byte firstBlockOf(byte sector) { return sector < 32 ? sector * 4 : 128 + (sector - 32) * 16; };
+	//! Returns the number of blocks in a sector (Mifare 1K/4K)
+	static constexpr byte blocksInSector(byte sector) { return sector < 32 ? 4 : 16; };
+
+	//! Returns the number of READ16 commands that read the whole memory of a tag type, 0 if unknown
+	static constexpr unsigned int dumpReads(byte tagType)
+	{
+		return tagType == MIFARE_ULTRALIGHT ? 4 : tagType == MIFARE_1K ? 64 : tagType == MIFARE_4K ? 256 : 0;
+	};
+	//! Returns the block number of the nth READ16 of a dump, or the page number for Mifare Ultralight, where one read returns four pages
+	static constexpr byte dumpAddress(byte tagType, unsigned int n) { return tagType == MIFARE_ULTRALIGHT ? 4 * n : n; };
+
+	//! Returns the error code of a response, 0 if it isn't one. Responses holding only a status, e.g. to AUTHENTICATE, return the status.
+	static byte errorOf(byte cmd, const byte* data, byte length)
+	{
+		SM130CommandInfo info;
+		getCommandInfo(cmd, &info);
+		return info.canFail && length == 1 ? data[0] : 0;
+	};
+
+	//! Store a value LSB first, as used by value commands
+	static void putValue(byte* data, int32_t value)
+	{
+		for (byte i = 0; i < 4; i++)
+			data[i] = (byte)(value >> (8 * i));
+	};
+
+	//! Returns a value stored LSB first
+	static int32_t getValue(const byte* data)
+	{
+		return (int32_t)((uint32_t)data[0] | (uint32_t)data[1] << 8 | (uint32_t)data[2] << 16 | (uint32_t)data[3] << 24);
+	};
+};
+
+/**	I2C framing: the packet without header.
+ */
+struct SM130I2CFraming
+{
+	static constexpr byte headerLength = 0;
+	static constexpr byte header(byte) { return 0; };
+};
+
+/**	UART framing: the packet with header 0xFF 0x00.
+ */
+struct SM130UARTFraming
+{
+	static constexpr byte headerLength = 2;
+	static constexpr byte header(byte i) { return i == 0 ? 0xff : 0x00; };
+};
+
+/**	Building and verification of frames.
+ */
+template <class Framing>
+struct SM130Frame
+{
+	//! Returns the size of a frame with a number of data bytes
+	static constexpr byte size(byte dataLength) { return Framing::headerLength + dataLength + 3; };
+
+	//! Returns the checksum of a command without data
+	static constexpr byte checksum(byte command) { return (byte)(1 + command); };
+
+	/**	Build a frame.
+	 *
+	 *	@param frame Destination, at least size(dataLength) bytes
+	 *	@param command Command code
+	 *	@param data Data bytes following the command
+	 *	@param dataLength Number of data bytes
+	 *	@return size of the frame
+	 */
+	static byte build(byte* frame, byte command, const byte* data, byte dataLength)
+	{
+		byte* p = frame;
+		for (byte i = 0; i < Framing::headerLength; i++)
+			*p++ = Framing::header(i);
+		byte sum = *p++ = dataLength + 1;
+		sum += *p++ = command;
+		for (byte i = 0; i < dataLength; i++)
+			sum += *p++ = data[i];
+		*p++ = sum;
+		return p - frame;
+	};
+
+	/**	Verify a received packet, without header.
+	 *
+	 *	@param packet Packet starting with the length byte
+	 *	@param received Number of bytes received
+	 *	@return length byte of the packet, 0 if there is no packet, or 0xff if truncated or invalid
+	 */
+	static byte verify(const byte* packet, byte received)
+	{
+		byte length = packet[0];
+		if (length == 0 || length > SM130_MAX_DATA + 1)
+			return 0;
+		if (received < length + 2)
+			return 0xff;
+		byte sum = 0;
+		for (byte i = 0; i <= length; i++)
+			sum += packet[i];
+		return sum == packet[length + 1] ? length : 0xff;
+	};
+};
+
+/**	Incremental frame parser, fed one byte at a time.
+ *
+ *	The parser hunts for the header, rejects lengths that don't fit in a
+ *	packet, and verifies the checksum. After an error it resumes the
+ *	header hunt, so it resynchronizes on the next frame.
+ */
+template <class Framing>
+class SM130Parser
+{
+	enum { STATE_LENGTH = Framing::headerLength, STATE_COMMAND, STATE_DATA, STATE_CHECKSUM };
+
+	byte state; //!< index of the header byte expected, or STATE_XX
+	byte index; //!< index of the next data byte
+	byte sum; //!< running checksum
+
+public:
+	static constexpr byte FRAME_COMPLETE = 1; //!< parse() result: a frame is complete
+	static constexpr byte FRAME_ERROR = 2; //!< parse() result: checksum error
+
+	byte command; //!< command of the frame
+	byte length; //!< number of data bytes of the frame
+	byte data[SM130_MAX_DATA]; //!< data bytes of the frame
+
+	SM130Parser() { reset(); };
+
+	//! Discard a partial frame
+	void reset() { state = 0; };
+
+	/**	Feed a byte to the parser.
+	 *
+	 *	@param b Received byte
+	 *	@return FRAME_COMPLETE if the byte completed a valid frame, FRAME_ERROR on a checksum error, else 0
+	 */
+	byte parse(byte b)
+	{
+		if (state < Framing::headerLength)
+		{
+			// the byte may be the start of the real header
+			state = b == Framing::header(state) ? state + 1 : b == Framing::header(0) ? 1 : 0;
+			return 0;
+		}
+		switch (state)
+		{
+		case STATE_LENGTH:
+			// length includes the command byte
+			if (b < 1 || b > SM130_MAX_DATA + 1)
+			{
+				resync(b);
+				return 0;
+			}
+			length = b - 1;
+			sum = b;
+			state = STATE_COMMAND;
+			return 0;
+
+		case STATE_COMMAND:
+			command = b;
+			sum += b;
+			index = 0;
+			state = length > 0 ? STATE_DATA : STATE_CHECKSUM;
+			return 0;
+
+		case STATE_DATA:
+			data[index++] = b;
+			sum += b;
+			if (index == length)
+				state = STATE_CHECKSUM;
+			return 0;
+
+		default:
+			if (b != sum)
+			{
+				resync(b);
+				return FRAME_ERROR;
+			}
+			state = 0;
+			return FRAME_COMPLETE;
+		}
+	};
+
+private:
+	void resync(byte b)
+	{
+		state = Framing::headerLength > 0 && b == Framing::header(0) ? 1 : 0;
+	};
+};
+
+/**	Authenticated session of the selected tag.
+ *
+ *	Repeated authentication of the sector with the same key is skipped.
+ *	The session starts when an AUTHENTICATE command is sent, holds once
+ *	it succeeded, and ends when a command fails, or a tag is sought,
+ *	selected or halted. A null key means the transport key.
+ */
+class SM130Session
+{
+	boolean valid; //!< true if sector is authenticated with keyType and key
+	byte sector; //!< last authenticated sector
+	byte keyType; //!< key type sent for the last authentication
+	byte key[6]; //!< key sent for the last authentication
+
+public:
+	SM130Session() : valid(false) {};
+
+	//! Returns true for key A or key B, which are sent with a key value
+	static constexpr boolean isKeyAB(byte keyType) { return keyType == 0xaa || keyType == 0xbb; };
+
+	//! Returns the key type to send: key A or B without key value is the transport key
+	static constexpr byte keyTypeOf(byte keyType, const byte* key) { return isKeyAB(keyType) && key == 0 ? 0xff : keyType; };
+
+	/**	Build the data of an AUTHENTICATE command.
+	 *
+	 *	Stored keys and the transport key are sent without key value.
+	 *
+	 *	@param data Destination, 8 bytes
+	 *	@param block Block number
+	 *	@param keyType 0xAA for key A, 0xBB for key B, 0x10-0x2F for a key
+	 *	stored in the SM130, 0xFF for the transport key
+	 *	@param key Key value (6 bytes) for key A or B, the transport key is used if null
+	 *	@return number of data bytes, 2 or 8
+	 */
+	static byte authData(byte* data, byte block, byte keyType, const byte* key)
+	{
+		data[0] = block;
+		data[1] = keyTypeOf(keyType, key);
+		if (!isKeyAB(data[1]))
+			return 2;
+		memcpy(data + 2, key, 6);
+		return 8;
+	};
+
+	//! Returns true if the sector of a block is authenticated with the key, key values are only compared for key A and B
+	boolean matches(byte block, byte keyType, const byte* key) const
+	{
+		keyType = keyTypeOf(keyType, key);
+		if (!valid || SM130Protocol::sectorOf(block) != sector || keyType != this->keyType)
+			return false;
+		return !isKeyAB(keyType) || memcmp(key, this->key, 6) == 0;
+	};
+
+	/**	Update the session for a command being sent.
+	 *
+	 *	@param cmd Command
+	 *	@param data Data bytes following the command
+	 *	@param length Number of data bytes
+	 */
+	void sent(byte cmd, const byte* data, byte length)
+	{
+		switch (cmd)
+		{
+		case SM130Protocol::CMD_AUTHENTICATE:
+			valid = false;
+			sector = SM130Protocol::sectorOf(data[0]);
+			keyType = data[1];
+			if (length == 8)
+				memcpy(key, data + 2, 6);
+			break;
+		case SM130Protocol::CMD_RESET:
+		case SM130Protocol::CMD_SEEK_TAG:
+		case SM130Protocol::CMD_SELECT_TAG:
+		case SM130Protocol::CMD_HALT_TAG:
+		case SM130Protocol::CMD_ANTENNA_POWER:
+		case SM130Protocol::CMD_SLEEP:
+			valid = false;
+			break;
+		}
+	};
+
+	/**	Update the session for a received response.
+	 *
+	 *	@param cmd Command of the response
+	 *	@param errorCode Error code of the response, see SM130Protocol::errorOf()
+	 */
+	void received(byte cmd, byte errorCode)
+	{
+		if (cmd == SM130Protocol::CMD_AUTHENTICATE)
+			valid = errorCode == 'L';
+		else if (errorCode != 0 && errorCode != 'L')
+			valid = false;
+	};
+
+	//! End the session, e.g. when a command got no response
+	void end() { valid = false; };
+};
+
+#define SM130_BATCH_SIZE 8 // maximum number of writes in a SM130WriteBatch
+
+/**	A write operation queued in a SM130WriteBatch.
+ */
+struct SM130Write
+{
+	byte command; //!< CMD_WRITE16, CMD_WRITE_VALUE, CMD_WRITE4, CMD_INC_VALUE or CMD_DEC_VALUE
+	byte block; //!< block, or page for CMD_WRITE4
+	byte data[16]; //!< 16-byte block, 4-byte page, or 4-byte value LSB first
+};
+
+template <class Transport> struct SM130Operations;
+
+/**	Several writes to one tag, executed back-to-back by SM130Operations::execute()
+ *	with one authentication per sector.
+ *
+ *	The add functions return false when the batch is full.
+ */
+class SM130WriteBatch
+{
+	static_assert(SM130_BATCH_SIZE <= 16, "execute() tracks at most 16 writes");
+
+	SM130Write ops[SM130_BATCH_SIZE];
+	byte opCount; //!< number of queued writes
+	byte failedAt; //!< index of the write that failed in the last execute()
+
+	template <class Transport> friend struct SM130Operations;
+
+	SM130Write* add(byte command, byte block)
+	{
+		if (opCount == SM130_BATCH_SIZE)
+			return 0;
+		SM130Write* op = &ops[opCount++];
+		op->command = command;
+		op->block = block;
+		return op;
+	};
+
+	boolean add(byte command, byte block, const byte* data, byte length)
+	{
+		SM130Write* op = add(command, block);
+		if (op)
+			memcpy(op->data, data, length);
+		return op != 0;
+	};
+
+	boolean addValue(byte command, byte block, int32_t value)
+	{
+		SM130Write* op = add(command, block);
+		if (op)
+			SM130Protocol::putValue(op->data, value);
+		return op != 0;
+	};
+
+public:
+	SM130WriteBatch() { clear(); };
+
+	//! Remove all writes
+	void clear() { opCount = failedAt = 0; };
+	//! Returns the number of queued writes
+	byte count() { return opCount; };
+	//! Returns the index of the write that failed in the last execute(), or count() if none did
+	byte failed() { return failedAt; };
+
+	//! Queue writing 16 bytes to a block
+	boolean writeBlock(byte block, const byte* data) { return add(SM130Protocol::CMD_WRITE16, block, data, 16); };
+	//! Queue formatting a value block with a value
+	boolean writeValueBlock(byte block, int32_t value) { return addValue(SM130Protocol::CMD_WRITE_VALUE, block, value); };
+	//! Queue writing 4 bytes to a Mifare Ultralight page
+	boolean writeUltralightPage(byte page, const byte* data) { return add(SM130Protocol::CMD_WRITE4, page, data, 4); };
+	//! Queue adding to a value block
+	boolean increment(byte block, int32_t delta) { return addValue(SM130Protocol::CMD_INC_VALUE, block, delta); };
+	//! Queue subtracting from a value block
+	boolean decrement(byte block, int32_t delta) { return addValue(SM130Protocol::CMD_DEC_VALUE, block, delta); };
+};
+
+/**	Blocking operations built on single commands, run by either driver.
+ *
+ *	The driver is the transport, with the member functions:
+ *	<pre>
+ *	boolean send(byte command, const byte* data, byte length);
+ *	byte receive(byte command, byte* data, byte size);
+ *	boolean isAuthenticated(byte block, byte keyType, const byte* key);
+ *	</pre>
+ *	send() returns false if the command could not be sent. receive() waits
+ *	for the response to the command, copies at most size data bytes, and
+ *	returns the number of data bytes of the response, or 0xff if none came.
+ *	The transport keeps an SM130Session up to date with the commands it
+ *	sends and the responses it receives, and answers isAuthenticated() from
+ *	it. Calls are resolved at compile time, the transport only needs to
+ *	befriend SM130Operations.
+ *
+ *	Results are SM130_DONE, 'L' for authentication, SM130_VALUE_XX for
+ *	transactions, else the error code of the failed command, or
+ *	SM130_NO_RESPONSE.
+ *
+ *	@tparam Transport Driver class
+ */
+template <class Transport>
+struct SM130Operations
+{
+	typedef SM130Protocol P;
+
+	/**	Send a command and wait for its response.
+	 *
+	 *	@return number of data bytes of the response, or 0xff if none came
+	 */
+	static byte exchange(Transport& t, byte cmd, const byte* data, byte length, byte* response, byte size)
+	{
+		return t.send(cmd, data, length) ? t.receive(cmd, response, size) : SM130_NO_RESPONSE;
+	};
+
+	//! Returns the result of a response that should have a number of data bytes
+	static byte result(byte received, const byte* response, byte expected)
+	{
+		return received == expected ? SM130_DONE : received == 1 ? response[0] : SM130_NO_RESPONSE;
+	};
+
+	//! Authenticate the sector of a block, unless it already is with the key. Returns 'L' on success.
+	static byte authenticate(Transport& t, byte block, byte keyType, const byte* key)
+	{
+		if (t.isAuthenticated(block, keyType, key))
+			return 'L';
+		byte data[8], status;
+		byte n = exchange(t, P::CMD_AUTHENTICATE, data, SM130Session::authData(data, block, keyType, key), &status, 1);
+		return n == 1 ? status : SM130_NO_RESPONSE;
+	};
+
+	//! Read a 16-byte block into response, after the block number (17 bytes)
+	static byte readBlock(Transport& t, byte block, byte* response)
+	{
+		return result(exchange(t, P::CMD_READ16, &block, 1, response, 17), response, 17);
+	};
+
+	//! Read a value block
+	static byte readValue(Transport& t, byte block, int32_t* value)
+	{
+		byte response[5];
+		byte status = result(exchange(t, P::CMD_READ_VALUE, &block, 1, response, 5), response, 5);
+		if (status == SM130_DONE)
+			*value = P::getValue(response + 1);
+		return status;
+	};
+
+	/**	Write a block or page, or change a value block.
+	 *
+	 *	The SM130 reads the block back after writing it. The response must
+	 *	echo the block number and, except for a value change, the data
+	 *	written. Writing 16 bytes to a Mifare Ultralight only stores the
+	 *	first page, so it is unverified unless the next pages hold the rest.
+	 *
+	 *	@param cmd CMD_WRITE16, CMD_WRITE_VALUE, CMD_WRITE4, CMD_INC_VALUE or CMD_DEC_VALUE
+	 *	@param block Block, or page for CMD_WRITE4
+	 *	@param data Data, 16 bytes for CMD_WRITE16, else 4 bytes
+	 *	@param response Destination for the block number and the data read back, 5 or 17 bytes
+	 *	@return SM130_DONE, SM130_UNVERIFIED, the error code of the command, or SM130_NO_RESPONSE
+	 */
+	static byte write(Transport& t, byte cmd, byte block, const byte* data, byte* response)
+	{
+		byte length = cmd == P::CMD_WRITE16 ? 16 : 4;
+		byte packet[17];
+		packet[0] = block;
+		memcpy(packet + 1, data, length);
+		byte status = result(exchange(t, cmd, packet, length + 1, response, length + 1), response, length + 1);
+		if (status != SM130_DONE)
+			return status;
+
+		// INC_VALUE and DEC_VALUE respond with the new value instead of the data
+		boolean change = cmd == P::CMD_INC_VALUE || cmd == P::CMD_DEC_VALUE;
+		if (response[0] != block || (!change && memcmp(response + 1, data, length) != 0))
+			return SM130_UNVERIFIED;
+		return SM130_DONE;
+	};
+
+	//! Add to or subtract from a value block (CMD_INC_VALUE or CMD_DEC_VALUE), the new value is returned in value unless it is 0
+	static byte changeValue(Transport& t, byte cmd, byte block, int32_t delta, int32_t* value)
+	{
+		byte data[4], response[5];
+		P::putValue(data, delta);
+		byte status = write(t, cmd, block, data, response);
+		if (status == SM130_DONE && value)
+			*value = P::getValue(response + 1);
+		return status;
+	};
+
+	/**	Change a value block in one transaction.
+	 *
+	 *	Authenticates the sector unless it already is, checks the balance
+	 *	unless expected is SM130_ANY_BALANCE, and changes the value. The
+	 *	response to the change holds the value read back, so verifying it
+	 *	takes no extra command.
+	 *
+	 *	@param cmd CMD_INC_VALUE or CMD_DEC_VALUE
+	 *	@param block Value block
+	 *	@param delta Amount to add or subtract
+	 *	@param expected Balance before the change, or SM130_ANY_BALANCE
+	 *	@param keyType Key type, 0xFF for the transport key
+	 *	@param key Key value (6 bytes) for key A or B
+	 *	@param balance Set to the balance after the change, or as read on a mismatch, unless it is 0
+	 *	@return SM130_VALUE_XX, or the error code of the failed command
+	 */
+	static byte transact(Transport& t, byte cmd, byte block, int32_t delta, int32_t expected, byte keyType, const byte* key, int32_t* balance)
+	{
+		byte status = authenticate(t, block, keyType, key);
+		if (status != 'L')
+			return status;
+
+		int32_t value;
+		if (expected != SM130_ANY_BALANCE)
+		{
+			status = readValue(t, block, &value);
+			if (status != SM130_DONE)
+				return status;
+			if (value != expected)
+			{
+				if (balance)
+					*balance = value;
+				return SM130_VALUE_MISMATCH;
+			}
+		}
+
+		status = changeValue(t, cmd, block, delta, &value);
+		if (status != SM130_DONE)
+			return status;
+		if (balance)
+			*balance = value;
+		if (expected != SM130_ANY_BALANCE && value != (cmd == P::CMD_INC_VALUE ? expected + delta : expected - delta))
+			return SM130_VALUE_UNVERIFIED;
+		return SM130_VALUE_DONE;
+	};
+
+	/**	Execute the writes of a batch on the selected tag.
+	 *
+	 *	Writes to the same sector are executed in order after one
+	 *	authentication, sectors in order of their first write. Mifare
+	 *	Ultralight pages need no authentication. Execution stops at the
+	 *	first failure, batch.failed() tells which.
+	 *
+	 *	@return SM130_DONE, or the error code of the failed authentication or write
+	 */
+	static byte execute(Transport& t, SM130WriteBatch& batch, byte keyType, const byte* key)
+	{
+		byte response[17];
+		uint16_t done = 0;
+
+		for (byte i = 0; i < batch.opCount; i++)
+		{
+			if (done & (1 << i))
+				continue;
+
+			// execute this write and all later ones to the same sector
+			SM130Write& first = batch.ops[i];
+			boolean ultralight = first.command == P::CMD_WRITE4;
+			byte sector = P::sectorOf(first.block);
+
+			if (!ultralight)
+			{
+				byte status = authenticate(t, first.block, keyType, key);
+				if (status != 'L')
+				{
+					batch.failedAt = i;
+					return status;
+				}
+			}
+
+			for (byte j = i; j < batch.opCount; j++)
+			{
+				SM130Write& op = batch.ops[j];
+				if ((done & (1 << j)) || (op.command == P::CMD_WRITE4) != ultralight ||
+					(!ultralight && P::sectorOf(op.block) != sector))
+					continue;
+
+				byte status = write(t, op.command, op.block, op.data, response);
+				if (status != SM130_DONE)
+				{
+					batch.failedAt = j;
+					return status;
+				}
+				done |= 1 << j;
+			}
+		}
+
+		batch.failedAt = batch.opCount;
+		return SM130_DONE;
+	};
+
+	/**	Read consecutive 16-byte blocks of a Mifare 1K/4K tag, authenticating once per sector.
+	 *
+	 *	The read stops after block 255, the last block number, rather than
+	 *	wrapping around to block 0: count is clamped to 256 - first.
+	 *
+	 *	@param buffer Destination for the block data (16 bytes per block)
+	 *	@return number of blocks read, short if a command failed or count was clamped
+	 */
+	static unsigned int readBlocks(Transport& t, byte first, unsigned int count, byte* buffer, byte keyType, const byte* key)
+	{
+		if (count > 256U - first)
+			count = 256U - first;
+
+		byte response[17];
+		byte sector = 0xff;
+		unsigned int n;
+		for (n = 0; n < count; n++)
+		{
+			byte block = first + n;
+
+			// Authenticate when entering a new sector
+			if (P::sectorOf(block) != sector)
+			{
+				sector = P::sectorOf(block);
+				if (authenticate(t, block, keyType, key) != 'L')
+					break;
+			}
+
+			if (readBlock(t, block, response) != SM130_DONE)
+				break;
+			memcpy(buffer + 16 * n, response + 1, 16);
+		}
+		return n;
+	};
+
+	/**	Read the whole memory of the tag in the field.
+	 *
+	 *	The tag is selected again to learn its type, which gives the memory
+	 *	layout: 64 blocks for Mifare 1K, 256 blocks in sectors of 4 and 16
+	 *	blocks for Mifare 4K, and 16 pages for Mifare Ultralight, read four
+	 *	at a time. Mifare 1K/4K sectors are authenticated once. Each block
+	 *	is passed to the sink as soon as it is read.
+	 *
+	 *	@return number of blocks passed to the sink (4 for a whole Ultralight).
+	 *	The dump stops at the first block that fails to authenticate or read,
+	 *	including a response that never came, so the count is then short.
+	 */
+	static unsigned int dumpCard(Transport& t, SM130DumpSink sink, byte keyType, const byte* key)
+	{
+		// Selecting the tag gives its type, and so the memory layout
+		byte response[17];
+		byte n = exchange(t, P::CMD_SELECT_TAG, 0, 0, response, 8);
+		if (n == SM130_NO_RESPONSE || n < 5)
+			return 0;
+
+		byte type = response[0];
+		byte sector = 0xff;
+		unsigned int i, count = P::dumpReads(type);
+		for (i = 0; i < count; i++)
+		{
+			byte block = P::dumpAddress(type, i);
+
+			// Authenticate when entering a new sector
+			if (type != P::MIFARE_ULTRALIGHT && P::sectorOf(block) != sector)
+			{
+				sector = P::sectorOf(block);
+				if (authenticate(t, block, keyType, key) != 'L')
+					break;
+			}
+
+			if (readBlock(t, block, response) != SM130_DONE)
+				break;
+			if (!sink(block, response + 1))
+				return i + 1;
+		}
+		return i;
+	};
+};
+
+#endif // SM130CORE_h
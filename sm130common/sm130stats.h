@@ -0,0 +1,134 @@
+/**
+ * 	@file	sm130stats.h
+ * 	@brief	Command statistics for the SM130 drivers
+ *
+ *	<p>
+ *	Instrumentation is compiled in when SM130_STATS is defined, either here
+ *	or on the compiler command line. It costs about 350 bytes of RAM per
+ *	driver instance. Latencies are measured with micros() from the first
+ *	transmission of a command until its valid response was received.
+ *	</p>
+ */
+
+#ifndef SM130STATS_h
+#define SM130STATS_h
+
+#if defined(ARDUINO) && ARDUINO >= 100
+#include "Arduino.h"
+#else
+#include "WProgram.h"
+#endif
+
+// Uncomment to enable instrumentation of the SM130 drivers
+//#define SM130_STATS
+
+// Execute a statement only if instrumentation is enabled
+#ifdef SM130_STATS
+#define SM130_STAT(statement) statement
+#else
+#define SM130_STAT(statement)
+#endif
+
+#define SM130_STATS_COMMANDS 0x17 // number of command codes (0x80-0x96)
+#define SM130_STATS_VERSION 1 // version of the binary dump format
+
+/**	Statistics of one command.
+ */
+struct SM130CommandStats
+{
+	uint16_t count; //!< number of valid responses
+	uint32_t min; //!< minimum latency in microseconds
+	uint32_t max; //!< maximum latency in microseconds
+	uint32_t total; //!< sum of latencies in microseconds
+};
+
+/**	Per-command latency and error counters.
+ */
+class SM130Stats
+{
+public:
+	SM130CommandStats command[SM130_STATS_COMMANDS]; //!< statistics per command code
+	uint16_t checksumErrors; //!< responses with invalid checksum
+	uint16_t wrongCommands; //!< responses to another command than the one sent
+	uint16_t timeouts; //!< commands that got no response in time
+	uint16_t retries; //!< commands sent again after a checksum error or time-out
+
+	SM130Stats() { reset(); };
+
+	//! Clear all counters
+	void reset() { memset(this, 0, sizeof(*this)); };
+
+	//! Record the latency of a valid response
+	void record(byte cmd, unsigned long latency)
+	{
+		SM130CommandStats* s = get(cmd);
+		if (s == 0)
+			return;
+		if (s->count == 0 || latency < s->min)
+			s->min = latency;
+		if (latency > s->max)
+			s->max = latency;
+		s->total += latency;
+		s->count++;
+	};
+
+	//! Returns the statistics of a command, or 0 for an invalid command code
+	SM130CommandStats* get(byte cmd)
+	{
+		return cmd >= 0x80 && cmd < 0x80 + SM130_STATS_COMMANDS ? &command[cmd - 0x80] : 0;
+	};
+
+	//! Returns the average latency of a command in microseconds
+	uint32_t average(byte cmd)
+	{
+		SM130CommandStats* s = get(cmd);
+		return s && s->count ? s->total / s->count : 0;
+	};
+
+	/**	Write the statistics in binary form.
+	 *
+	 *	Format, multi-byte values little-endian:<br>
+	 *	'S' 'M' version(1) checksumErrors(2) wrongCommands(2) timeouts(2) retries(2) n(1)<br>
+	 *	followed by n records of commands with a non-zero count:<br>
+	 *	command(1) count(2) min(4) average(4) max(4)
+	 *
+	 *	@param out Destination, e.g. Serial
+	 *	@return number of bytes written
+	 */
+	size_t dump(Print& out)
+	{
+		size_t n = out.write('S') + out.write('M') + out.write((uint8_t)SM130_STATS_VERSION);
+		n += write(out, checksumErrors, 2) + write(out, wrongCommands, 2);
+		n += write(out, timeouts, 2) + write(out, retries, 2);
+
+		byte records = 0;
+		for (byte i = 0; i < SM130_STATS_COMMANDS; i++)
+		{
+			if (command[i].count)
+				records++;
+		}
+		n += out.write(records);
+
+		for (byte i = 0; i < SM130_STATS_COMMANDS; i++)
+		{
+			if (command[i].count == 0)
+				continue;
+			n += out.write((uint8_t)(0x80 + i));
+			n += write(out, command[i].count, 2);
+			n += write(out, command[i].min, 4);
+			n += write(out, average(0x80 + i), 4);
+			n += write(out, command[i].max, 4);
+		}
+		return n;
+	};
+
+private:
+	static size_t write(Print& out, uint32_t value, byte size)
+	{
+		for (byte i = 0; i < size; i++)
+			out.write((uint8_t)(value >> (8 * i)));
+		return size;
+	};
+};
+
+#endif // SM130STATS_h
@@ -0,0 +1,133 @@
+/**
+ * 	@file	sm130timing.h
+ * 	@brief	Per-command response time estimates for the SM130 drivers
+ *
+ *	<p>
+ *	Response times differ by an order of magnitude between commands, from a
+ *	HALT_TAG to a write or a reset, and between tags. SM130Timing learns a
+ *	smoothed response time and its mean deviation for each command from the
+ *	responses the driver receives, as TCP does for round-trip times. Drivers
+ *	use it to poll for a response when it is expected rather than after a
+ *	fixed delay, and to time out after a margin over what the command
+ *	usually takes. Until a command has responded, the datasheet defaults of
+ *	the command descriptor table apply.
+ *	</p>
+ */
+
+#ifndef SM130TIMING_h
+#define SM130TIMING_h
+
+#include <sm130core.h>
+
+#define SM130_TIMING_COMMANDS 0x17 // number of command codes (0x80-0x96)
+#define SM130_PACE_DEFAULT 20 // time (ms) until the first poll for a response that was never measured
+#define SM130_POLL_MIN 2 // minimum time (ms) between I2C transactions
+#define SM130_TIMEOUT_MIN 20 // minimum learned time-out (ms)
+
+/**	Learned response times per command.
+ *
+ *	Times are kept in 1/8 ms, 0 if the command was never measured.
+ */
+class SM130Timing
+{
+	uint16_t latency[SM130_TIMING_COMMANDS]; //!< smoothed response time
+	uint16_t deviation[SM130_TIMING_COMMANDS]; //!< smoothed mean deviation of the response time
+
+	//! Returns the index of a command, or SM130_TIMING_COMMANDS if it has no entry
+	static byte indexOf(byte cmd)
+	{
+		return cmd >= SM130Protocol::CMD_RESET && cmd < SM130Protocol::CMD_RESET + SM130_TIMING_COMMANDS ?
+			cmd - SM130Protocol::CMD_RESET : SM130_TIMING_COMMANDS;
+	};
+
+	//! Returns true for the commands that write or change a value block or key (WRITE16 to DEC_VALUE)
+	static constexpr boolean changesTag(byte cmd)
+	{
+		return cmd >= SM130Protocol::CMD_WRITE16 && cmd <= SM130Protocol::CMD_DEC_VALUE;
+	};
+
+public:
+	SM130Timing() { reset(); };
+
+	//! Forget all measurements
+	void reset()
+	{
+		memset(latency, 0, sizeof(latency));
+		memset(deviation, 0, sizeof(deviation));
+	};
+
+	/**	Record the response time of a command.
+	 *
+	 *	Only responses to commands sent once should be recorded, as the
+	 *	response to a command sent again can't be told from a late one.
+	 *
+	 *	@param cmd Command
+	 *	@param us Time from sending the command to receiving the response, in microseconds
+	 *	@param early true if the response was there at the first poll, so it may have been ready sooner
+	 */
+	void record(byte cmd, unsigned long us, boolean early)
+	{
+		byte i = indexOf(cmd);
+		if (i == SM130_TIMING_COMMANDS)
+			return;
+		long m = min(us / 125, 0xffffUL / 2);
+		if (m == 0)
+			m = 1;
+		if (latency[i] == 0)
+		{
+			latency[i] = m;
+			deviation[i] = m / 2;
+		}
+		else if (early)
+		{
+			// the measured time is only an upper bound, probe for a shorter one
+			latency[i] = max(latency[i] - max(latency[i] / 8, 1), 1);
+			deviation[i] -= deviation[i] / 8;
+		}
+		else
+		{
+			long error = m - latency[i];
+			latency[i] = max(latency[i] + error / 8, 1L);
+			deviation[i] += ((error < 0 ? -error : error) - (long)deviation[i]) / 4;
+		}
+	};
+
+	//! Returns the time (ms) after which the response to a command is expected
+	unsigned int expected(byte cmd)
+	{
+		byte i = indexOf(cmd);
+		return i == SM130_TIMING_COMMANDS || latency[i] == 0 ? SM130_PACE_DEFAULT : (latency[i] + 7) / 8;
+	};
+
+	//! Returns the time (ms) between polls for a response that came later than expected
+	unsigned int repoll(byte cmd)
+	{
+		byte i = indexOf(cmd);
+		return i == SM130_TIMING_COMMANDS || latency[i] == 0 ? SM130_PACE_DEFAULT : max(deviation[i] / 8, SM130_POLL_MIN);
+	};
+
+	/**	Returns the time-out (ms) of a command.
+	 *
+	 *	Twice the smoothed response time plus four deviations, at most four
+	 *	times the default of the command. It is at least SM130_TIMEOUT_MIN,
+	 *	and at least the default for commands that can't be sent again or
+	 *	change the tag: giving up on them early loses a write or a value
+	 *	change that may still complete, and a write takes longer on some
+	 *	tags than the ones measured so far.
+	 */
+	unsigned int timeout(byte cmd)
+	{
+		SM130CommandInfo info;
+		SM130Protocol::getCommandInfo(cmd, &info);
+		byte i = indexOf(cmd);
+		if (i == SM130_TIMING_COMMANDS || latency[i] == 0)
+			return info.timeout;
+		unsigned long t = (2UL * latency[i] + 4UL * deviation[i]) / 8; // 1/8 ms to ms
+		unsigned int least = !info.retry || changesTag(cmd) ? info.timeout : SM130_TIMEOUT_MIN;
+		if (t < least)
+			return least;
+		return t < 4UL * info.timeout ? t : 4UL * info.timeout;
+	};
+};
+
+#endif // SM130TIMING_h
@@ -0,0 +1,130 @@
+/**
+ * 	@file	sm130trace.h
+ * 	@brief	Ring buffer of raw SM130 packets for debugging
+ *
+ *	<p>
+ *	Recording a packet only copies it to RAM, so tracing does not change the
+ *	timing of the communication with the SM130. The buffer is drained to a
+ *	serial port in idle time, or on demand, and decoded on the host by
+ *	host/tracedump.cpp. When the buffer is full, the oldest packets are
+ *	discarded.
+ *	</p>
+ */
+
+#ifndef SM130TRACE_h
+#define SM130TRACE_h
+
+#if defined(ARDUINO) && ARDUINO >= 100
+#include "Arduino.h"
+#else
+#include "WProgram.h"
+#endif
+
+#define SM130_TRACE_HEADER 0xc0 // marks the start of a record, bits 0-4 are the packet length
+#define SM130_TRACE_RECEIVED 0x20 // header bit for packets received from the SM130
+#define SM130_TRACE_LENGTH 0x1f // header bits of the packet length
+#define SM130_TRACE_OVERHEAD 5 // header(1) + timestamp(4)
+
+/**	Ring buffer of timestamped packets.
+ *
+ *	Record format, multi-byte values little-endian:<br>
+ *	header(1) micros(4) packet(n)<br>
+ *	header is SM130_TRACE_HEADER | direction | n, with direction
+ *	SM130_TRACE_RECEIVED for received packets and 0 for sent packets.
+ *	A header without direction and length reports discarded records,
+ *	their number takes the place of the timestamp.
+ */
+class SM130Trace
+{
+	byte* buffer; //!< storage of the ring
+	size_t size; //!< size of the storage
+	size_t head; //!< index of the oldest byte
+	size_t count; //!< number of bytes in the ring
+	uint32_t discarded; //!< records discarded since the last drain
+
+public:
+	/**	Constructor.
+	 *
+	 *	@param buffer Storage of the ring, must remain valid while in use
+	 *	@param size Size of the storage, at least SM130_TRACE_OVERHEAD + 20 bytes to hold any packet
+	 */
+	SM130Trace(byte* buffer, size_t size) : buffer(buffer), size(size) { clear(); };
+
+	//! Discard all records
+	void clear() { head = count = 0; discarded = 0; };
+
+	//! Returns the number of bytes waiting to be drained
+	size_t available() const { return count; };
+
+	//! Returns the number of records discarded since the last drain
+	uint32_t getDiscarded() const { return discarded; };
+
+	/**	Record a packet, discarding the oldest records if the ring is full.
+	 *
+	 *	@param received true for a packet received from the SM130, false for a sent packet
+	 *	@param packet Packet bytes
+	 *	@param length Length of the packet, at most SM130_TRACE_LENGTH
+	 */
+	void record(boolean received, const byte* packet, byte length)
+	{
+		length &= SM130_TRACE_LENGTH;
+		if ((size_t)length + SM130_TRACE_OVERHEAD > size)
+		{
+			discarded++;
+			return;
+		}
+		while (count + length + SM130_TRACE_OVERHEAD > size)
+		{
+			size_t oldest = (buffer[head] & SM130_TRACE_LENGTH) + SM130_TRACE_OVERHEAD;
+			head = (head + oldest) % size;
+			count -= oldest;
+			discarded++;
+		}
+		put(SM130_TRACE_HEADER | (received ? SM130_TRACE_RECEIVED : 0) | length);
+		uint32_t now = micros();
+		for (byte i = 0; i < 4; i++)
+			put(now >> (8 * i));
+		for (byte i = 0; i < length; i++)
+			put(packet[i]);
+	};
+
+	/**	Write whole records to a serial port, oldest first.
+	 *
+	 *	@param out Destination, e.g. Serial
+	 *	@param budget Maximum number of bytes to write, e.g. Serial.availableForWrite() to never block
+	 *	@return number of bytes written
+	 */
+	size_t drain(Print& out, size_t budget = (size_t)-1)
+	{
+		size_t n = 0;
+		if (discarded > 0 && budget >= SM130_TRACE_OVERHEAD)
+		{
+			n += out.write((uint8_t)SM130_TRACE_HEADER);
+			for (byte i = 0; i < 4; i++)
+				n += out.write((uint8_t)(discarded >> (8 * i)));
+			discarded = 0;
+		}
+		while (count > 0)
+		{
+			size_t record = (buffer[head] & SM130_TRACE_LENGTH) + SM130_TRACE_OVERHEAD;
+			if (n + record > budget)
+				break;
+			for (size_t i = 0; i < record; i++)
+			{
+				n += out.write(buffer[head]);
+				head = (head + 1) % size;
+			}
+			count -= record;
+		}
+		return n;
+	};
+
+private:
+	void put(byte b)
+	{
+		buffer[(head + count) % size] = b;
+		count++;
+	};
+};
+
+#endif // SM130TRACE_h
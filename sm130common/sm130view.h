@@ -0,0 +1,121 @@
+/**
+ * 	@file	sm130view.h
+ * 	@brief	Views of SM130 response data, without copying it out of the packet buffer
+ *
+ *	<p>
+ *	A view refers into the driver's packet buffer, and is only valid until
+ *	the driver receives the next response. Hexadecimal formatting of a tag
+ *	number is only done when asked for.
+ *	</p>
+ */
+
+#ifndef SM130VIEW_h
+#define SM130VIEW_h
+
+#if defined(ARDUINO) && ARDUINO >= 100
+#include "Arduino.h"
+#else
+#include "WProgram.h"
+#endif
+
+/**	View of a tag number in a SEEK_TAG or SELECT_TAG response.
+ */
+class SM130TagView
+{
+	const byte* uid; //!< tag number in the packet buffer
+	byte length; //!< length of tag number in bytes (4 or 7), 0 if no tag
+	byte type; //!< type of tag
+
+public:
+	SM130TagView() : uid(0), length(0), type(0) {};
+	SM130TagView(byte type, const byte* uid, byte length) : uid(uid), length(length), type(type) {};
+
+	//! Returns true if the view refers to a tag number
+	boolean valid() const { return length > 0; };
+	//! Returns a pointer to the tag number
+	const byte* data() const { return uid; };
+	//! Returns the length of the tag number in bytes (4 or 7)
+	byte size() const { return length; };
+	//! Returns the tag type (MIFARE_XX)
+	byte getType() const { return type; };
+
+	//! Returns true if both views refer to the same tag number
+	boolean operator==(const SM130TagView& other) const
+	{
+		return length == other.length && memcmp(uid, other.uid, length) == 0;
+	};
+
+	/**	Format the tag number as uppercase hexadecimal null-terminated string.
+	 *
+	 *	@param s Destination, at least 2 * size() + 1 characters
+	 *	@return s
+	 */
+	char* toHex(char* s) const
+	{
+		char* p = s;
+		for (byte i = 0; i < length; i++)
+		{
+			*p++ = hexDigit(uid[i] >> 4);
+			*p++ = hexDigit(uid[i]);
+		}
+		*p = 0;
+		return s;
+	};
+
+	/**	Print the tag number as uppercase hexadecimal, without a buffer.
+	 *
+	 *	@param out Destination, e.g. Serial
+	 *	@return number of characters printed
+	 */
+	size_t printTo(Print& out) const
+	{
+		size_t n = 0;
+		for (byte i = 0; i < length; i++)
+		{
+			n += out.write(hexDigit(uid[i] >> 4));
+			n += out.write(hexDigit(uid[i]));
+		}
+		return n;
+	};
+
+private:
+	static char hexDigit(byte b)
+	{
+		b &= 0x0f;
+		return b < 10 ? b + '0' : b + 'A' - 10;
+	};
+};
+
+/**	Receives the tags found in continuous seek mode.
+ *
+ *	@param tag Tag type and number, valid until the function returns
+ */
+typedef void (*SM130TagCallback)(SM130TagView tag);
+
+/**	View of the payload of a response packet.
+ */
+class SM130ResponseView
+{
+	const byte* payload; //!< response data in the packet buffer, after the command byte
+	byte length; //!< length of the response data
+	byte command; //!< command the response belongs to
+
+public:
+	SM130ResponseView() : payload(0), length(0), command(0) {};
+	SM130ResponseView(byte command, const byte* payload, byte length) : payload(payload), length(length), command(command) {};
+
+	//! Returns the command the response belongs to
+	byte getCommand() const { return command; };
+	//! Returns a pointer to the response data, after the command byte
+	const byte* data() const { return payload; };
+	//! Returns the length of the response data
+	byte size() const { return length; };
+	//! Returns the response data byte at an index
+	byte operator[](byte i) const { return payload[i]; };
+	//! Returns true if the response only holds a status code, which is returned by getStatus()
+	boolean isStatus() const { return length == 1; };
+	//! Returns the status code of a status-only response, or 0
+	byte getStatus() const { return length == 1 ? payload[0] : 0; };
+};
+
+#endif // SM130VIEW_h
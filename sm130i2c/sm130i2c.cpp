@@ -24,6 +24,9 @@
 
 #include "sm130i2c.h"
 
+// DREADY interrupt flag
+volatile boolean SM130::responseReady = false;
+
 // local functions
 void arrayToHex(char *s, byte array[], byte len);
 char toHex(byte b);
@@ -40,8 +43,17 @@ SM130::SM130()
 	address = 0x42;
 	pinRESET = 3;
 	pinDREADY = 4;
+	useInterrupt = false;
 	debug = false;
+	trace = 0;
+	async = false;
 	t = millis() + 10;
+	queueHead = queueCount = 0;
+	polls = 0xff;
+	pending = resend = responseLocal = false;
+	seekCallback = 0;
+	tagType = tagLength = *tagString = 0;
+	*versionString = 0;
 }
 
 /* Public member functions ****************************************************/
@@ -59,15 +71,42 @@ SM130::SM130()
  *	If pinDREADY has the value 0xff (-1), the SM130 will be polled over I2C while
  *	in SEEK mode, otherwise the DREADY pin will be polled in SEEK mode.
  *	For other commands, response polling is always over I2C.
+ *
+ *	If useInterrupt is true and pinDREADY is an external interrupt pin, the
+ *	rising edge of DREADY latches a flag, and responses to all commands are
+ *	only read from the bus once the SM130 signals one is available. A signalled
+ *	response is read without waiting for the pacing window.
+ *	Only one SM130 instance can use interrupt mode.
+ *
+ *	Reset always runs in blocking mode, and discards any queued commands.
  */
 void SM130::reset()
 {
+	boolean wasAsync = async;
+	async = false;
+	queueCount = 0;
+	pending = resend = responseLocal = false;
+	session.end();
+
 	// Init DREADY pin
 	if (pinDREADY != 0xff)
 	{
 		pinMode(pinDREADY, INPUT);
 	}
 
+	// Init DREADY interrupt
+	if (useInterrupt)
+	{
+		if (pinDREADY != 0xff && digitalPinToInterrupt(pinDREADY) != NOT_AN_INTERRUPT)
+		{
+			attachInterrupt(digitalPinToInterrupt(pinDREADY), dreadyISR, RISING);
+		}
+		else
+		{
+			useInterrupt = false;
+		}
+	}
+
 	// Init RESET pin
 	if (pinRESET != 0xff) // hardware reset
 	{
@@ -89,6 +128,8 @@ void SM130::reset()
 
 	// To cancel automatic seek mode after reset, we send a HALT_TAG command
 	haltTag();
+
+	async = wasAsync;
 }
 
 /**	Get the firmware version string.
@@ -100,14 +141,16 @@ const char* SM130::getFirmwareVersion()
 		return versionString;
 
 	// else send VERSION command and retry a few times if no response
+	sendCommand(CMD_VERSION);
 	for (byte n = 0; n < 10; n++)
 	{
-		sendCommand(CMD_VERSION);
-		if (available() && getCommand() == CMD_VERSION)
+		if (wait() && getCommand() == CMD_VERSION)
 			return versionString;
-		delay(100);
+		// resend if the command timed out
+		if (!busy())
+			sendCommand(CMD_VERSION);
 	}
-	// time-out after 1s
+	// no response after 10 tries, each within the time-out of VERSION
 	return 0;
 }
 
@@ -116,92 +159,197 @@ const char* SM130::getFirmwareVersion()
  *	This function should always be called and return true prior to using results
  *	of a command.
  *
+ *	In blocking mode, it waits until the response to the last command is
+ *	expected, as learned by getTiming() from previous responses, then reads
+ *	it. Reads without response are repeated after the usual deviation of the
+ *	response time. In non-blocking mode (async is true), it returns false
+ *	immediately if that time has not yet passed. Otherwise it either
+ *	transmits the next queued command, or reads the response of the pending
+ *	command. Call it from loop() as often as possible to keep the queue
+ *	moving.
+ *
+ *	A pending SEEK_TAG command is abandoned when another command is queued,
+ *	as any new command terminates the SM130's seek mode. Other commands get
+ *	the time-out of their command descriptor to respond (SM130_TIMEOUT, more
+ *	for writes and RESET), until getTiming() has learned their response time,
+ *	then a margin over it. A command that times out, or gets a response with
+ *	a bad checksum or for another command, is sent again up to MAX_RETRIES
+ *	times if the command allows it, and is dropped otherwise.
+ *
+ *	In continuous seek mode, see startSeek(), a tag found is passed to the
+ *	callback before available() returns, and SEEK_TAG is sent again whenever
+ *	no other command is queued or pending.
+ *
  *	@returns	true if a valid response packet is available
  */
 boolean SM130::available()
 {
+	// Response produced without bus transaction, see authenticate()
+	if (responseLocal)
+	{
+		responseLocal = false;
+		return true;
+	}
+
+	// Wait until the response is expected, or the bus has been quiet long enough.
+	// When DREADY signalled a response, it can be read right away.
+	if (async)
+	{
+		if (!ready() && !(responseReady && !resend))
+		{
+			idle();
+			return false;
+		}
+	}
+	else
+	{
+		while (!ready() && !(responseReady && !resend))
+			idle();
+	}
+
+	// Send the last command again after a failure
+	if (resend)
+	{
+		transmitPacket();
+		return false;
+	}
+
+	// Send the next command if the previous one is done or superseded
+	if (queueCount > 0 && ready() && (!pending || cmd == CMD_SEEK_TAG))
+	{
+		transmitNext();
+		return false;
+	}
+
+	// Nothing to receive, seek again in continuous seek mode
+	if (!pending)
+	{
+		if (seekCallback && queueCount == 0)
+			seekTag();
+		idle();
+		return false;
+	}
+
+	// If using DREADY interrupt, only read when a response was signalled.
+	// The pin level catches responses left unread from a previous command.
+	// The response to a command other than SEEK_TAG must arrive in time
+	SM130CommandInfo info;
+	getCommandInfo(cmd, &info);
+	boolean expired = cmd != CMD_SEEK_TAG && millis() - tcmd > timing.timeout(cmd);
+
+	if (useInterrupt)
+	{
+		if (!responseReady && !digitalRead(pinDREADY))
+		{
+			if (expired)
+			{
+				SM130_STAT(stats.timeouts++);
+				retry();
+			}
+			idle();
+			return false;
+		}
+		responseReady = false;
+	}
 	// If in SEEK mode and using DREADY pin, check the status
-	if (cmd == CMD_SEEK_TAG && pinDREADY != 0xff)
+	else if (cmd == CMD_SEEK_TAG && pinDREADY != 0xff)
 	{
 		if (!digitalRead(pinDREADY))
+		{
+			idle();
 			return false;
+		}
 	}
 
-	// Set the maximum length of the expected response packet
-	byte len;
-	switch(cmd)
+	// Request exactly the maximum length of the expected response packet. It
+	// is read aside, so a poll without a valid response leaves the last one intact.
+	byte packet[SIZE_PACKET];
+	byte n = receiveData(packet, SM130Frame<SM130I2CFraming>::size(info.maxData));
+
+	// Send again if the response is corrupt or for another command
+	if (n == 0xff || (n > 0 && packet[1] != cmd))
 	{
-	case CMD_ANTENNA_POWER:
-	case CMD_AUTHENTICATE:
-	case CMD_DEC_VALUE:
-	case CMD_INC_VALUE:
-	case CMD_WRITE_KEY:
-	case CMD_HALT_TAG:
-	case CMD_SLEEP:
-		len = 4;
-		break;
-	case CMD_WRITE4:
-	case CMD_WRITE_VALUE:
-	case CMD_READ_VALUE:
-		len = 8;
-	case CMD_SEEK_TAG:
-	case CMD_SELECT_TAG:
-		len = 11;
-		break;
-	default:
-		len = SIZE_PACKET;
+		SM130_STAT(n == 0xff ? stats.checksumErrors++ : stats.wrongCommands++);
+		retry();
+		return false;
+	}
+
+	// No response yet
+	if (n == 0 && expired)
+	{
+		SM130_STAT(stats.timeouts++);
+		retry();
+		return false;
+	}
+
+	// Poll again after the usual deviation, or at the default pace while a seek is in progress
+	if (n == 0 && polls != 0xff)
+	{
+		t = millis() + timing.repoll(cmd);
+		polls++;
+	}
+	else if (n == 0)
+	{
+		t = millis() + SM130_PACE_DEFAULT;
 	}
 
 	// If valid data received, process the response packet
-	if (receiveData(len) > 0)
+	if (n > 0)
 	{
+		memcpy(data, packet, n + 2);
+		SM130_STAT(stats.record(cmd, micros() - tstart));
+
+		// Learn from the first response to a command sent once. It may have
+		// been ready before the first poll.
+		if (polls != 0xff && retries == 0)
+			timing.record(cmd, micros() - tsent, polls == 0 && !useInterrupt);
+		polls = 0xff;
+
 		// Init response variables
 		tagType = tagLength = *tagString = 0;
 
-		// If packet length is 2, the command failed. Set error code.
-		errorCode = getPacketLength() < 3 ? data[2] : 0;
+		// If the packet has the length of an error response, set error code.
+		errorCode = info.canFail && getPacketLength() == 2 ? data[2] : 0;
+
+		// A seek in progress will produce another response when a tag is found
+		pending = getCommand() == CMD_SEEK_TAG && errorCode == 'L';
+
+		// A failed command ends the authenticated session
+		session.received(getCommand(), errorCode);
 
 		// Process command response
-		switch (getCommand())
+		switch (info.parser)
 		{
-		case CMD_RESET:
-		case CMD_VERSION:
+		case SM130_PARSE_VERSION:
 			// RESET and VERSION commands produce the firmware version
-			len = min(getPacketLength(), sizeof(versionString)) - 1;
-			memcpy(versionString, data + 2, len);
-			versionString[len] = 0;
+			{
+				byte len = min(getPacketLength(), sizeof(versionString)) - 1;
+				memcpy(versionString, data + 2, len);
+				versionString[len] = 0;
+			}
 			break;
 
-		case CMD_SEEK_TAG:
-		case CMD_SELECT_TAG:
+		case SM130_PARSE_TAG:
 			// If no error, get tag number
 			if(errorCode == 0 && getPacketLength() >= 6)
 			{
 				tagLength = getPacketLength() - 2;
 				tagType = data[2];
-				memcpy(tagNumber, data + 3, tagLength);
-				arrayToHex(tagString, tagNumber, tagLength);
 			}
 			break;
 
-		case CMD_AUTHENTICATE:
-			break;
-
-		case CMD_READ16:
-			break;
-
-		case CMD_WRITE16:
-		case CMD_WRITE4:
-			break;
-
-		case CMD_ANTENNA_POWER:
-			errorCode = 0;
+		case SM130_PARSE_ANTENNA:
 			antennaPower = data[2];
 			break;
+		}
 
-		case CMD_SLEEP:
-			// If in SLEEP mode, no data is available
-			return false;
+		// Report a tag found in continuous seek mode, which ends when the RF field is off
+		if (seekCallback && getCommand() == CMD_SEEK_TAG)
+		{
+			if (tagLength > 0)
+				seekCallback(getTag());
+			else if (errorCode == 'U')
+				seekCallback = 0;
 		}
 
 		// Data available
@@ -211,6 +359,19 @@ boolean SM130::available()
 	return false;
 }
 
+/**	Get the tag number of the last SEEK_TAG or SELECT_TAG response as hex string.
+ *
+ *	The string is formatted on the first call after the response was received.
+ *
+ *	@return	Tag number as uppercase hexadecimal null-terminated string, empty if no tag
+ */
+const char* SM130::getTagString()
+{
+	if (*tagString == 0 && tagLength > 0)
+		arrayToHex(tagString, data + 3, tagLength);
+	return tagString;
+}
+
 /**	Get error message for last command.
  *
  *	@return	Human-readable error message as a null-terminated string
@@ -233,7 +394,7 @@ const char* SM130::getErrorMessage()
 		if(getCommand() == CMD_WRITE16 || getCommand() == CMD_WRITE4) return "Verification failed";
 		return "Antenna off";
 	case 'F':
-		if(getCommand() == CMD_READ16) return "Read failed";
+		if(getCommand() == CMD_READ16 || getCommand() == CMD_READ_VALUE) return "Read failed";
 		return "Write failed";
 	case 'I':
 		return "Invalid value block";
@@ -249,55 +410,189 @@ const char* SM130::getErrorMessage()
 /**	Turns on/off the RF field.
  *
  *	@param level 0 is off, anything else is on
+ *	@return false if the command queue is full
  */
-void SM130::setAntennaPower(byte level)
+boolean SM130::setAntennaPower(byte level)
 {
+	byte* packet = newPacket(CMD_ANTENNA_POWER, 2);
+	if (packet == 0)
+		return false;
 	antennaPower = level;
-	data[0] = 2;
-	data[1] = CMD_ANTENNA_POWER;
-	data[2] = antennaPower;
+	packet[2] = antennaPower;
 	transmitData();
+	return true;
 }
 
 /** Authenticate with transport key (0xFFFFFFFFFFFF).
+ *
+ *	If the sector is already authenticated with the same key, no command is
+ *	sent, and available() reports a successful authentication right away.
  *
  *	@param block Block number
+ *	@return false if the command queue is full
  */
-void SM130::authenticate(byte block)
+boolean SM130::authenticate(byte block)
 {
-	data[0] = 3;
-	data[1] = CMD_AUTHENTICATE;
-	data[2] = block;
-	data[3] = 0xff;
-	transmitData();
+	return authenticate(block, 0xff, 0);
 }
 
 /** Authenticate with specified key A or key B.
+ *
+ *	The authenticated session is remembered until a command fails, or a tag
+ *	is sought, selected or halted. Only while the SM130 is idle, repeated
+ *	authentication of the same sector with the same key is skipped: no command
+ *	is sent, and available() reports a successful authentication right away.
  *
  *	@param block Block number
- *	@param keyType Which key to use: 0xAA for key A or 0xBB for key B
- *	@param key Key value (6 bytes)
+ *	@param keyType Which key to use: 0xAA for key A or 0xBB for key B, 0x10-0x2F
+ *	for a key stored in the SM130, or 0xFF for the transport key
+ *	@param key Key value (6 bytes) for key A or B, the transport key is used if null
+ *	@return false if the command queue is full
  */
-void SM130::authenticate(byte block, byte keyType, byte key[6])
+boolean SM130::authenticate(byte block, byte keyType, byte key[6])
 {
-	data[0] = 9;
-	data[1] = CMD_AUTHENTICATE;
-	data[2] = block;
-	data[3] = keyType;
-	memcpy(data + 4, key, 6);
-	transmitData();
+	// Skip if the sector is already authenticated with this key
+	if (isAuthenticated(block, keyType, key))
+	{
+		data[0] = 2;
+		data[1] = CMD_AUTHENTICATE;
+		data[2] = 'L';
+		data[3] = data[0] + data[1] + data[2];
+		errorCode = 'L';
+		tagType = tagLength = *tagString = 0;
+		responseLocal = true;
+		return true;
+	}
+
+	// Stored keys and the transport key are sent without key value
+	byte packet[8];
+	return send(CMD_AUTHENTICATE, packet, SM130Session::authData(packet, block, keyType, key));
 }
 
 /**	Read 16-byte block.
  *
  *	@param block Block number
+ *	@return false if the command queue is full
  */
-void SM130::readBlock(byte block)
+boolean SM130::readBlock(byte block)
 {
-	data[0] = 2;
-	data[1] = CMD_READ16;
-	data[2] = block;
+	byte* packet = newPacket(CMD_READ16, 2);
+	if (packet == 0)
+		return false;
+	packet[2] = block;
 	transmitData();
+	return true;
+}
+
+/**	Read consecutive 16-byte blocks of a Mifare 1K/4K tag.
+ *
+ *	The blocks are authenticated once per sector, and each command is sent
+ *	as soon as the response to the previous one is read. This function blocks
+ *	until all blocks are read or a command fails, also in non-blocking mode.
+ *	On failure, getCommand() and getErrorCode() tell which command failed.
+ *
+ *	@param first Number of the first block
+ *	@param count Number of blocks to read, at most 256 - first as block 255 is the last
+ *	@param buffer Destination for the block data (16 bytes per block)
+ *	@param keyType Which key to use: 0xAA for key A, 0xBB for key B, 0xFF for transport key
+ *	@param key Key value (6 bytes), ignored for the transport key
+ *	@return Number of blocks read
+ */
+unsigned int SM130::readBlocks(byte first, unsigned int count, byte* buffer, byte keyType, byte key[6])
+{
+	return SM130Operations<SM130>::readBlocks(*this, first, count, buffer, keyType, key);
+}
+
+/**	Read all blocks of a Mifare 1K/4K sector, including the sector trailer.
+ *
+ *	@param sector Sector number (0-15 for 1K, 0-39 for 4K)
+ *	@param buffer Destination for the block data (64 bytes, 256 bytes for sectors 32-39)
+ *	@param keyType Which key to use: 0xAA for key A, 0xBB for key B, 0xFF for transport key
+ *	@param key Key value (6 bytes), ignored for the transport key
+ *	@return Number of blocks read
+ */
+unsigned int SM130::readSector(byte sector, byte* buffer, byte keyType, byte key[6])
+{
+	return readBlocks(firstBlockOf(sector), blocksInSector(sector), buffer, keyType, key);
+}
+
+/**	Read the whole memory of the tag in the field.
+ *
+ *	The tag is selected again to learn its type, which gives the memory
+ *	layout: 64 blocks for Mifare 1K, 256 blocks in sectors of 4 and 16 blocks
+ *	for Mifare 4K, and 16 pages for Mifare Ultralight, read four at a time.
+ *	Mifare 1K/4K sectors are authenticated once, Ultralight pages need no
+ *	authentication. Each block is passed to the sink as soon as it is read,
+ *	so no buffer for the whole card is needed. This function blocks until
+ *	the dump is done, a command fails or the sink returns false, also in
+ *	non-blocking mode. On failure, getCommand() and getErrorCode() tell
+ *	which command failed.
+ *
+ *	@param sink Function receiving each block
+ *	@param keyType Which key to use: 0xAA for key A, 0xBB for key B, 0xFF for transport key
+ *	@param key Key value (6 bytes), ignored for the transport key
+ *	@return Number of blocks passed to the sink (4 for a whole Ultralight)
+ */
+unsigned int SM130::dumpCard(SM130DumpSink sink, byte keyType, byte key[6])
+{
+	return SM130Operations<SM130>::dumpCard(*this, sink, keyType, key);
+}
+
+/**	Execute the writes of a batch on the selected tag.
+ *
+ *	Writes to the same sector are executed in order after one
+ *	authentication, sectors in order of their first write. Mifare
+ *	Ultralight pages need no authentication. This function blocks until
+ *	the batch is done or a write fails, also in non-blocking mode.
+ *
+ *	@param batch Writes to execute, batch.failed() tells which one failed
+ *	@param keyType Which key to use: 0xAA for key A, 0xBB for key B, 0xFF for transport key
+ *	@param key Key value (6 bytes), ignored for the transport key
+ *	@return SM130_DONE, SM130_UNVERIFIED if a write wasn't echoed, the error code of the failed command, or 0xff if a command got no response
+ */
+byte SM130::execute(SM130WriteBatch& batch, byte keyType, byte key[6])
+{
+	return SM130Operations<SM130>::execute(*this, batch, keyType, key);
+}
+
+/**	Seek tags continuously.
+ *
+ *	Sends SEEK_TAG, and again after each tag found or other command, so the
+ *	SM130 keeps seeking while available() is called. Each tag found is
+ *	passed to the callback from available(). Seeking ends with stopSeek(),
+ *	or when the RF field is off.
+ *
+ *	@param callback Function receiving each tag found
+ */
+void SM130::startSeek(SM130TagCallback callback)
+{
+	seekCallback = callback;
+	if (!busy())
+		seekTag();
+}
+
+/**	Change a value block in one transaction.
+ *
+ *	Authenticates the sector, unless it is already authenticated with the
+ *	key. If a balance is expected, reads the value first, and leaves it
+ *	unchanged when it differs. Then changes the value. The response to
+ *	INC_VALUE and DEC_VALUE holds the value read back after the change, so
+ *	verifying it takes no extra command. This function blocks until the
+ *	transaction is done, also in non-blocking mode. Afterwards,
+ *	getBlockValue() returns the balance: after the change, or as read on a
+ *	mismatch.
+ *
+ *	@param cmd CMD_INC_VALUE or CMD_DEC_VALUE
+ *	@param block Block number of the value block
+ *	@param delta Amount to add or subtract
+ *	@param expected Balance before the change, or SM130_ANY_BALANCE to skip the check
+ *	@param keyType Which key to use: 0xAA for key A, 0xBB for key B, 0xFF for transport key
+ *	@param key Key value (6 bytes), ignored for the transport key
+ *	@return SM130_VALUE_XX, the error code of the failed command, or 0xff if a command got no response
+ */
+byte SM130::transact(byte cmd, byte block, int32_t delta, int32_t expected, byte keyType, byte key[6])
+{
+	return SM130Operations<SM130>::transact(*this, cmd, block, delta, expected, keyType, key, 0);
 }
 
 /**	Write 16-byte block.
@@ -307,15 +602,18 @@ void SM130::readBlock(byte block)
  *
  *	@param block Block number
  *	@param message Null-terminated string of up to 15 characters
+ *	@return false if the command queue is full
  */
-void SM130::writeBlock(byte block, const char* message)
+boolean SM130::writeBlock(byte block, const char* message)
 {
-	data[0] = 18;
-	data[1] = CMD_WRITE16;
-	data[2] = block;
-	strncpy((char*)data + 3, message, 15);
-	data[18] = 0;
+	byte* packet = newPacket(CMD_WRITE16, 18);
+	if (packet == 0)
+		return false;
+	packet[2] = block;
+	strncpy((char*)packet + 3, message, 15);
+	packet[18] = 0;
 	transmitData();
+	return true;
 }
 
 /**	Write 4-byte block.
@@ -324,85 +622,295 @@ void SM130::writeBlock(byte block, const char* message)
  *
  *	@param block Block number
  *	@param message Null-terminated string of up to 3 characters
+ *	@return false if the command queue is full
  */
-void SM130::writeFourByteBlock(byte block, const char* message)
+boolean SM130::writeFourByteBlock(byte block, const char* message)
 {
-	data[0] = 6;
-	data[1] = CMD_WRITE4;
-	data[2] = block;
-	strncpy((char*)data + 3, message, 3);
-	data[6] = 0;
+	byte* packet = newPacket(CMD_WRITE4, 6);
+	if (packet == 0)
+		return false;
+	packet[2] = block;
+	strncpy((char*)packet + 3, message, 3);
+	packet[6] = 0;
 	transmitData();
+	return true;
 }
 
 /**	Send 1-byte command.
  *
  *	@param cmd Command
+ *	@return false if the command queue is full
+ */
+boolean SM130::sendCommand(byte cmd)
+{
+	if (newPacket(cmd, 1) == 0)
+		return false;
+	transmitData();
+	return true;
+}
+
+/**	Send a write command.
+ *
+ *	@param cmd CMD_WRITE16 or CMD_WRITE4
+ *	@param block Block number, or page for CMD_WRITE4
+ *	@param data Data bytes to write
+ *	@param length Number of data bytes, 16 or 4
+ *	@return false if the command queue is full
+ */
+boolean SM130::sendData(byte cmd, byte block, const byte* data, byte length)
+{
+	byte* packet = newPacket(cmd, length + 2);
+	if (packet == 0)
+		return false;
+	packet[2] = block;
+	memcpy(packet + 3, data, length);
+	transmitData();
+	return true;
+}
+
+/**	Send a value command.
+ *
+ *	The response holds the block number and the value of the block, after
+ *	the change for WRITE_VALUE, INC_VALUE and DEC_VALUE, see getBlockValue().
+ *	The block must be authenticated.
+ *
+ *	@param cmd CMD_READ_VALUE, CMD_WRITE_VALUE, CMD_INC_VALUE or CMD_DEC_VALUE
+ *	@param block Block number
+ *	@param value Value, or amount to add or subtract
+ *	@param length Packet length, 2 for READ_VALUE
+ *	@return false if the command queue is full
+ */
+boolean SM130::sendValue(byte cmd, byte block, int32_t value, byte length)
+{
+	byte* packet = newPacket(cmd, length);
+	if (packet == 0)
+		return false;
+	packet[2] = block;
+	if (length == 6)
+		putValue(packet + 3, value);
+	transmitData();
+	return true;
+}
+
+/**	Send a command with data.
+ *
+ *	@param cmd Command
+ *	@param data Data bytes following the command
+ *	@param length Number of data bytes
+ *	@return false if the command queue is full
  */
-void SM130::sendCommand(byte cmd)
+boolean SM130::send(byte cmd, const byte* data, byte length)
 {
-	data[0] = 1;
-	data[1] = cmd;
+	byte* packet = newPacket(cmd, length + 1);
+	if (packet == 0)
+		return false;
+	memcpy(packet + 2, data, length);
 	transmitData();
+	return true;
+}
+
+/**	Run the command engine until the response to a command is available,
+ *	and copy its data.
+ *
+ *	The response also stays in the packet buffer, so getCommand(),
+ *	getErrorCode() and getBlockValue() tell about it afterwards.
+ *
+ *	@param cmd Command
+ *	@param buffer Destination for the data bytes after the command byte
+ *	@param size Size of the destination
+ *	@return number of data bytes of the response, or 0xff if none came
+ */
+byte SM130::receive(byte cmd, byte* buffer, byte size)
+{
+	if (!waitFor(cmd))
+		return 0xff;
+	byte n = getPacketLength() - 1;
+	memcpy(buffer, data + 2, min(n, size));
+	return n;
 }
 
 /* Private member functions ****************************************************/
 
 
-/**	Transmit a packet with checksum to the SM130.
+/**	Get a free command packet at the tail of the queue.
+ *
+ *	The length byte and command are filled in, the caller fills in the
+ *	command parameters and calls transmitData().
+ *	The queue can only fill up in non-blocking mode. Running the command
+ *	engine to make room would throw away the responses it reads, so the
+ *	caller gets no packet and can send the command again after available().
+ *
+ *	@param	cmd Command
+ *	@param	length Packet length, including command byte, excluding checksum
+ *	@return	pointer to the packet, or 0 if the queue is full
+ */
+byte* SM130::newPacket(byte cmd, byte length)
+{
+	if (queueCount == SIZE_QUEUE)
+		return 0;
+	byte* packet = queue[(queueHead + queueCount) % SIZE_QUEUE];
+	packet[0] = length;
+	packet[1] = cmd;
+	return packet;
+}
+
+/**	Add the packet obtained by newPacket() to the queue.
+ *
+ *	In blocking mode the packet is transmitted immediately, after waiting
+ *	until at least SM130_POLL_MIN ms passed since the last I2C transaction.
+ *	In non-blocking mode, the packet will be transmitted by available().
  */
 void SM130::transmitData()
 {
-	// wait until at least 20ms passed since last I2C transmission
-	while(t > millis());
-	t = millis() + 20;
+	queueCount++;
+
+	if (!async)
+	{
+		while (queueCount > 0)
+		{
+			while (!ready());
+			transmitNext();
+		}
+	}
+}
+
+/**	Run the command engine until a response is available.
+ *
+ *	Gives up when the pending command is dropped after time-outs. A pending
+ *	SEEK_TAG is dropped if no tag was found within SM130_TIMEOUT ms.
+ *
+ *	@return	true if a response is available
+ */
+boolean SM130::wait()
+{
+	while (busy())
+	{
+		if (available())
+			return true;
+		// available() handles time-outs, except for SEEK_TAG
+		if (pending && cmd == CMD_SEEK_TAG && queueCount == 0 && millis() - tcmd > SM130_TIMEOUT)
+			pending = false;
+	}
+	return false;
+}
 
-	// init checksum and packet length
-	byte sum = 0;
-	byte len = data[0] + 1;
+/**	Run the command engine until the response to a command is available.
+ *
+ *	Responses to other commands still in the queue are skipped.
+ *
+ *	@param	command Command to wait for
+ *	@return	true if the response is available
+ */
+boolean SM130::waitFor(byte command)
+{
+	while (wait())
+	{
+		if (getCommand() == command)
+			return true;
+	}
+	return false;
+}
 
-	// remember which command was sent
-	cmd = data[1];
+/**	Transmit the packet at the head of the queue to the SM130.
+ */
+void SM130::transmitNext()
+{
+	memcpy(sent, queue[queueHead], SIZE_PACKET);
+	queueHead = (queueHead + 1) % SIZE_QUEUE;
+	queueCount--;
+	retries = 0;
+	SM130_STAT(tstart = micros());
+	transmitPacket();
+}
 
-	// transmit packet with checksum
-	Wire.beginTransmission(address);
-	for (int i = 0; i < len; i++)
+/**	Send the last command again if it may be retried, else drop it.
+ */
+void SM130::retry()
+{
+	SM130CommandInfo info;
+	getCommandInfo(cmd, &info);
+	if (info.retry && retries < MAX_RETRIES)
 	{
-#if defined(ARDUINO) && ARDUINO >= 100
-		Wire.write(data[i]);
-#else
-		Wire.send(data[i]);
-#endif
-		sum += data[i];
+		retries++;
+		SM130_STAT(stats.retries++);
+		resend = true;
+	}
+	else
+	{
+		pending = false;
+		session.end();
 	}
+}
+
+/**	Transmit the last sent packet with checksum to the SM130.
+ */
+void SM130::transmitPacket()
+{
+	byte* packet = sent;
+	resend = false;
+
+	// remember which command was sent, SLEEP has no response
+	cmd = packet[1];
+	pending = cmd != CMD_SLEEP;
+	session.sent(cmd, packet + 2, packet[0] - 1);
+
+	// poll for the response when it is expected
+	t = millis() + timing.expected(cmd);
+	tcmd = millis();
+	tsent = micros();
+	polls = 0;
+	responseReady = false;
+
+	// append the checksum in place, and transmit the packet in one go
+	byte len = SM130Frame<SM130I2CFraming>::build(packet, cmd, packet + 2, packet[0] - 1);
+	Wire.beginTransmission(address);
 #if defined(ARDUINO) && ARDUINO >= 100
-	Wire.write(sum);
+	Wire.write(packet, len);
 #else
-	Wire.send(sum);
+	Wire.send(packet, len);
 #endif
 	Wire.endTransmission();
 
 	// show transmitted packet for debugging
-	if (debug)
+	if (debug && trace)
+	{
+		trace->record(false, packet, len);
+	}
+	else if (debug)
 	{
 		Serial.print("> ");
-		printArrayHex(data, len);
+		printArrayHex(packet, len - 1);
 		Serial.print(' ');
-		printHex(sum);
+		printHex(packet[len - 1]);
 		Serial.println();
 	}
 }
 
+/**	Writes recorded packets of the debug trace to the Serial port.
+ *
+ *	Only whole records that fit in the transmit buffer are written, so this
+ *	never waits for the Serial port. Use trace->drain(Serial) to write all
+ *	records on demand.
+ */
+void SM130::idle()
+{
+	if (trace == 0 || trace->available() == 0)
+		return;
+#if defined(ARDUINO) && ARDUINO >= 10606
+	trace->drain(Serial, Serial.availableForWrite());
+#endif
+}
+
 /**	Receives a packet from the SM130 and verifies the checksum.
  *
+ *	@param packet destination for the packet, SIZE_PACKET bytes
  *	@param length the number of bytes to receive
  *	@return the number of bytes in the payload, or -1 if bad checksum
  */
-byte SM130::receiveData(byte length)
+byte SM130::receiveData(byte* packet, byte length)
 {
-	// wait until at least 20ms passed since last I2C transmission
-	while(t > millis());
-	t = millis() + 20;
+	// caller has waited until the response is expected, keep the bus quiet for a moment
+	t = millis() + SM130_POLL_MIN;
 
 	// read response
 	Wire.requestFrom(address, length);
@@ -414,35 +922,37 @@ byte SM130::receiveData(byte length)
 		for (byte i = 0; i < n;)
 		{
 #if defined(ARDUINO) && ARDUINO >= 100
-			data[i++] = Wire.read();
+			packet[i++] = Wire.read();
 #else
-			data[i++] = Wire.receive();
+			packet[i++] = Wire.receive();
 #endif
 		}
 
 		// show received packet for debugging
-		if (debug && data[0] > 0 )
+		if (debug && trace && packet[0] > 0)
+		{
+			trace->record(true, packet, n);
+		}
+		else if (debug && packet[0] > 0 )
 		{
 			Serial.print("< ");
-			printArrayHex(data, n);
+			printArrayHex(packet, n);
 			Serial.println();
 		}
 
-		// verify checksum if length > 0 and <= SIZE_PAYLOAD
-		if (data[0] > 0 && data[0] <= SIZE_PAYLOAD)
-		{
-			byte i, sum;
-			for (i = 0, sum = 0; i <= data[0]; i++)
-			{
-				sum += data[i];
-			}
-			// return with length of response, or -1 if invalid checksum
-			return sum == data[i] ? data[0] : -1;
-		}
+		// verify checksum, return with length of response, or -1 if invalid
+		return SM130Frame<SM130I2CFraming>::verify(packet, n);
 	}
 	return 0;
 }
 
+/**	Latches the rising edge of the DREADY pin.
+ */
+void SM130::dreadyISR()
+{
+	responseReady = true;
+}
+
 /**	Maps tag types to names.
  *
  *	@param	type numeric tag type
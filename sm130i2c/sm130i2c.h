@@ -14,8 +14,16 @@
 #include "WProgram.h"
 #endif
 
-#define SIZE_PAYLOAD 18 // maximum payload size of I2C packet
+#include <sm130core.h>
+#include <sm130stats.h>
+#include <sm130timing.h>
+#include <sm130trace.h>
+#include <sm130view.h>
+
+#define SIZE_PAYLOAD (SM130_MAX_DATA + 1) // maximum payload size of I2C packet
 #define SIZE_PACKET (SIZE_PAYLOAD + 2) // total I2C packet size, including length byte and checksum
+#define SIZE_QUEUE 4 // maximum number of queued command packets in non-blocking mode
+#define MAX_RETRIES SM130_MAX_RETRIES // maximum number of times a command is sent again
 
 #define halt haltTag // deprecated function halt() renamed to haltTag()
 
@@ -27,52 +35,56 @@ void printHex(byte val);
 /**	Class representing a <a href="http://www.sonmicro.com/en/index.php?option=com_content&view=article&id=57&Itemid=70">SonMicro SM130 RFID module</a>.
  *
  *	Nearly complete implementation of the <a href="http://www.sonmicro.com/en/downloads/Mifare/ds_SM130.pdf">SM130 datasheet</a>.<br>
- *	Functions dealing with value blocks and stored keys are not implemented.
+ *	Functions dealing with stored keys are not implemented.
+ *
+ *	In non-blocking mode, commands are queued for available() to send. The
+ *	functions sending a command return false when the queue is full; call
+ *	available() to move the queue along and send the command again.
  */
-class SM130
+class SM130 : public SM130Protocol
 {
 	byte data[SIZE_PACKET]; //!< packet data
 	char versionString[8]; //!< version string
-	byte tagNumber[7]; //!< tag number as byte array
-	byte tagLength; //!< length of tag number in bytes (4 or 7)
-	char tagString[15]; //!< tag number as hex string
+	byte tagLength; //!< length of tag number in bytes (4 or 7), the tag number itself is in data
+	char tagString[15]; //!< tag number as hex string, formatted by getTagString() when empty
 	byte tagType; //!< type of tag
 	char errorCode; //!< error code from some commands
 	byte antennaPower; //!< antenna power level
 	byte cmd; //!< last sent command
 	unsigned long t; //!< timer for sending I2C commands
+	unsigned long tcmd; //!< time the last command was sent
+	unsigned long tsent; //!< time in microseconds the last command was sent
+	byte polls; //!< number of reads without response since the last command was sent, 0xff after its response
+	SM130Timing timing; //!< learned response times
+	byte queue[SIZE_QUEUE][SIZE_PACKET]; //!< command packets waiting to be sent
+	byte queueHead; //!< index of the next packet to be sent
+	byte queueCount; //!< number of packets in the queue
+	byte sent[SIZE_PACKET]; //!< last sent command packet
+	boolean pending; //!< true while waiting for the response to the last sent command
+	boolean resend; //!< true if the last sent command must be sent again
+	byte retries; //!< number of times the last command was sent again
+	static volatile boolean responseReady; //!< set by DREADY interrupt when a response is available
+	boolean responseLocal; //!< true if a response was produced without a bus transaction
+	SM130Session session; //!< authenticated session
+	SM130TagCallback seekCallback; //!< receives the tags found in continuous seek mode, 0 if not seeking
+#ifdef SM130_STATS
+	SM130Stats stats; //!< command statistics
+	unsigned long tstart; //!< time in microseconds the last command was first sent
+#endif
 
 public:
 	static const int VERSION = 1;  //!< version of this library
 
-	static const byte MIFARE_ULTRALIGHT  = 1;
-	static const byte MIFARE_1K  = 2;
-	static const byte MIFARE_4K  = 3;
+	// tag types (MIFARE_XX), command codes (CMD_XX), sectorOf(), firstBlockOf()
+	// and blocksInSector() are inherited from SM130Protocol
 
-	static const byte CMD_RESET = 0x80;
-	static const byte CMD_VERSION = 0x81;
-	static const byte CMD_SEEK_TAG = 0x82;
-	static const byte CMD_SELECT_TAG = 0x83;
-	static const byte CMD_AUTHENTICATE = 0x85;
-	static const byte CMD_READ16 = 0x86;
-	static const byte CMD_READ_VALUE = 0x87;
-	static const byte CMD_WRITE16 = 0x89;
-	static const byte CMD_WRITE_VALUE = 0x8a;
-	static const byte CMD_WRITE4 = 0x8b;
-	static const byte CMD_WRITE_KEY = 0x8c;
-	static const byte CMD_INC_VALUE = 0x8d;
-	static const byte CMD_DEC_VALUE = 0x8e;
-	static const byte CMD_ANTENNA_POWER = 0x90;
-	static const byte CMD_READ_PORT = 0x91;
-	static const byte CMD_WRITE_PORT = 0x92;
-	static const byte CMD_HALT_TAG = 0x93;
-	static const byte CMD_SET_BAUD = 0x94;
-	static const byte CMD_SLEEP = 0x96;
-
-	boolean debug; //!< debug mode, prints all I2C communication to Serial port
+	boolean debug; //!< debug mode, prints all I2C communication to Serial port, or records it in trace
+	SM130Trace* trace; //!< buffer for debug mode, drained to Serial port in idle time, or 0 to print right away
+	boolean async; //!< non-blocking mode, commands are queued and executed by available()
 	byte address; //!< I2C address (default 0x42)
 	byte pinRESET; //!< RESET pin (default 3)
 	byte pinDREADY; //!< DREADY pin (default 4)
+	boolean useInterrupt; //!< use external interrupt on DREADY pin to detect responses
 
 	//! Constructor
 	SM130();
@@ -82,6 +94,16 @@ public:
 	const char* getFirmwareVersion();
 	//! Returns true if a response packet is available
 	boolean available();
+	//! Returns true if commands are queued or a response is pending
+	boolean busy() { return pending || responseLocal || queueCount > 0; };
+	//! Returns the number of queued commands
+	byte queued() { return queueCount; };
+	//! Returns the learned response times, used to poll for responses and to time out
+	SM130Timing& getTiming() { return timing; };
+#ifdef SM130_STATS
+	//! Returns the command statistics
+	SM130Stats& getStats() { return stats; };
+#endif
 	//! Returns a pointer to the response packet
 	byte* getRawData() { return data; };
 	//! Returns the last executed command
@@ -96,12 +118,18 @@ public:
 	byte getBlockNumber() { return data[2]; };
 	//! Returns a pointer to the read block (with a length of 16 bytes)
 	byte* getBlock() { return data+3; };
-	//! Returns the tag's serial number as a byte array
-	byte* getTagNumber() { return tagNumber; };
+	//! Returns the value of a value block after READ_VALUE, WRITE_VALUE, INC_VALUE or DEC_VALUE
+	int32_t getBlockValue() { return SM130Protocol::getValue(data+3); };
+	//! Returns the response payload as a view into the packet buffer
+	SM130ResponseView getResponse() { return SM130ResponseView(data[1], data+2, data[0]-1); };
+	//! Returns the tag's serial number as a view into the packet buffer, valid until the next response
+	SM130TagView getTag() { return SM130TagView(tagType, data+3, tagLength); };
+	//! Returns the tag's serial number as a byte array in the packet buffer, valid until the next response
+	byte* getTagNumber() { return data+3; };
 	//! Returns the length of the tag's serial number obtained by getTagNumer()
 	byte getTagLength() { return tagLength; };
 	//! Returns the tag's serial number as a hexadecimal null-terminated string
-	const char* getTagString() { return tagString; };
+	const char* getTagString();
 	//! Returns the tag type (SM130::MIFARE_XX)
 	byte getTagType() { return tagType; };
 	//! Returns the tag type as a null-terminated string
@@ -113,35 +141,103 @@ public:
 	//! Returns the antenna power level (0 or 1)
 	byte getAntennaPower() { return antennaPower; };
 	//! Sends a SEEK_TAG command
-	void seekTag() { sendCommand(CMD_SEEK_TAG); };
+	boolean seekTag() { return sendCommand(CMD_SEEK_TAG); };
 	//! Sends a SELECT_TAG command
-	void selectTag() { sendCommand(CMD_SELECT_TAG); };
+	boolean selectTag() { return sendCommand(CMD_SELECT_TAG); };
+	//! Seeks tags continuously, passing each one found to a callback
+	void startSeek(SM130TagCallback callback);
+	//! Stops continuous seek
+	void stopSeek() { seekCallback = 0; };
+	//! Returns true in continuous seek mode
+	boolean isSeeking() { return seekCallback != 0; };
 	//! Sends a HALT_TAG command
-	void haltTag() { sendCommand(CMD_HALT_TAG); };
+	boolean haltTag() { return sendCommand(CMD_HALT_TAG); };
 	//! Set antenna power (on/off)
-	void setAntennaPower(byte level);
+	boolean setAntennaPower(byte level);
 	//! Sends a SLEEP command (can only wake-up with hardware reset!)
-	void sleep() { sendCommand(CMD_SLEEP); };
+	boolean sleep() { return sendCommand(CMD_SLEEP); };
 	//! Writes a null-terminated string of maximum 15 characters
-	void writeBlock(byte block, const char* message);
+	boolean writeBlock(byte block, const char* message);
 	//! Writes a null-terminated string of maximum 3 characters to a Mifare Ultralight
-	void writeFourByteBlock(byte block, const char* message);
+	boolean writeFourByteBlock(byte block, const char* message);
+	//! Writes 16 bytes to a block
+	boolean writeBlock(byte block, const byte* data) { return sendData(CMD_WRITE16, block, data, 16); };
+	//! Writes 4 bytes to a Mifare Ultralight page
+	boolean writeUltralightPage(byte page, const byte* data) { return sendData(CMD_WRITE4, page, data, 4); };
 	//! Sends a AUTHENTICATE command using the transport key
-	void authenticate(byte block);
+	boolean authenticate(byte block);
 	//! Sends a AUTHENTICATE command using the specified key
-	void authenticate(byte block, byte keyType, byte key[6]);
+	boolean authenticate(byte block, byte keyType, byte key[6]);
 	//! Reads a 16-byte block
-	void readBlock(byte block);
+	boolean readBlock(byte block);
+	//! Reads consecutive 16-byte blocks into a buffer, authenticating once per sector
+	unsigned int readBlocks(byte first, unsigned int count, byte* buffer, byte keyType = 0xff, byte key[6] = 0);
+	//! Reads all blocks of a sector into a buffer
+	unsigned int readSector(byte sector, byte* buffer, byte keyType = 0xff, byte key[6] = 0);
+	//! Reads the whole memory of the selected tag, passing each block to a sink
+	unsigned int dumpCard(SM130DumpSink sink, byte keyType = 0xff, byte key[6] = 0);
+	//! Executes the writes of a batch, authenticating once per sector
+	byte execute(SM130WriteBatch& batch, byte keyType = 0xff, byte key[6] = 0);
+	//! Reads a value block
+	boolean readValueBlock(byte block) { return sendValue(CMD_READ_VALUE, block, 0, 2); };
+	//! Formats a value block with a value
+	boolean writeValueBlock(byte block, int32_t value) { return sendValue(CMD_WRITE_VALUE, block, value); };
+	//! Adds to a value block
+	boolean increment(byte block, int32_t delta) { return sendValue(CMD_INC_VALUE, block, delta); };
+	//! Subtracts from a value block
+	boolean decrement(byte block, int32_t delta) { return sendValue(CMD_DEC_VALUE, block, delta); };
+	//! Subtracts from a value block in one transaction, after checking the expected balance
+	byte debit(byte block, int32_t amount, int32_t expected = SM130_ANY_BALANCE, byte keyType = 0xff, byte key[6] = 0)
+	{
+		return transact(CMD_DEC_VALUE, block, amount, expected, keyType, key);
+	};
+	//! Adds to a value block in one transaction, after checking the expected balance
+	byte credit(byte block, int32_t amount, int32_t expected = SM130_ANY_BALANCE, byte keyType = 0xff, byte key[6] = 0)
+	{
+		return transact(CMD_INC_VALUE, block, amount, expected, keyType, key);
+	};
 
 private:
+	friend struct SM130Operations<SM130>;
+
 	//! Send single-byte command
-	void sendCommand(byte cmd);
-	//! Transmit command packet over I2C
+	boolean sendCommand(byte cmd);
+	//! Send a command with data, for SM130Operations, false if the queue is full
+	boolean send(byte cmd, const byte* data, byte length);
+	//! Wait for the response to a command and copy its data, for SM130Operations
+	byte receive(byte cmd, byte* data, byte size);
+	//! Send a write command with block number and data
+	boolean sendData(byte cmd, byte block, const byte* data, byte length);
+	//! Send a value command with block number and, if length is 6, a 4-byte value
+	boolean sendValue(byte cmd, byte block, int32_t value, byte length = 6);
+	//! Authenticate, check the balance, and change a value block
+	byte transact(byte cmd, byte block, int32_t delta, int32_t expected, byte keyType, byte key[6]);
+	//! Returns a free command packet at the tail of the queue
+	byte* newPacket(byte cmd, byte length);
+	//! Queue the command packet obtained by newPacket()
 	void transmitData();
+	//! Transmit the next queued command packet over I2C
+	void transmitNext();
+	//! Transmit the last sent command packet over I2C
+	void transmitPacket();
+	//! Send the last command again if allowed, else drop it
+	void retry();
+	//! Returns true if the sector of a block is authenticated with the specified key, and no command is pending
+	boolean isAuthenticated(byte block, byte keyType, const byte* key) { return !busy() && session.matches(block, keyType, key); };
+	//! Drain the debug trace to the Serial port without blocking
+	void idle();
+	//! Returns true if the minimum time between I2C transactions has passed
+	boolean ready() { return (long)(millis() - t) >= 0; };
+	//! Run the command engine until a response is available or time-out
+	boolean wait();
+	//! Run the command engine until the response to a command is available or time-out
+	boolean waitFor(byte command);
 	//! Receive response packet over I2C
-	byte receiveData(byte length);
+	byte receiveData(byte* packet, byte length);
 	//! Returns human-readable tag name corresponding to tag type
 	const char* tagName(byte type);
+	//! Interrupt service routine for DREADY pin
+	static void dreadyISR();
 };
 
 #endif // SM130_h
@@ -1,6 +1,21 @@
 #include "sm130uart.h"
-#define sm130_PACKBUFFSIZE 9
-uint8_t sm130_packetbuffer[sm130_PACKBUFFSIZE];
+#include <bufferedserial.h>
+
+// Baud rates indexed by SET_BAUD_RATE code
+static const unsigned long nfc_baud_rates[] = { 9600, 19200, 38400, 57600, 115200 };
+
+// Port used until setSerial() is called, none for port types other than Stream
+template <class Port>
+static Port* nfc_default_port() { return 0; }
+
+template <>
+Stream* nfc_default_port<Stream>() {
+#if defined(__AVR_ATmega32U4__) || defined(__MK20DX128__)
+  return &Serial1;
+#else
+  return &Serial;
+#endif
+}
 
 
 /**************************************************************************/
@@ -9,13 +24,22 @@ uint8_t sm130_packetbuffer[sm130_PACKBUFFSIZE];
 
 */
 /**************************************************************************/
-NFCReader::NFCReader()
+template <class Port>
+NFCReaderT<Port>::NFCReaderT()
 { 
-#if defined(__AVR_ATmega32U4__) || defined(__MK20DX128__)
-	_nfc = &Serial1;
-#else
-    _nfc = &Serial;
-#endif
+  _tag_length = 0;
+  _last_command = NFC_NONE;
+  _sent_ms = 0;
+  _timeout = NFC_TIMEOUT;
+  _frame_count = 0;
+  _baud_callback = 0;
+  _baud = 19200;
+  _seek_state = SEEK_OFF;
+  _tag_callback = 0;
+  _sent_length = 0;
+  _retries = 0;
+  _trace = 0;
+  _nfc = nfc_default_port<Port>();
 }
 
 /* Packet Configuration 
@@ -39,118 +63,414 @@ CHECKSUM (All bytes except header)
     @brief  Function for sending raw data from sm130 over UART
 
     @param  command  Specific command being requested of sm130
-    @param  data     Buffer to store response from server into
-    @param  length   Number of bytes of data
+    @param  data     Data bytes following the command
+    @param  len      Number of bytes of data
+    @return true, the port takes every frame
 */
 /**************************************************************************/
-void NFCReader::send(nfc_command_t command, uint8_t *data, int len) {
+template <class Port>
+bool NFCReaderT<Port>::send(uint8_t command, const uint8_t *data, uint8_t len) {
+
+  // A queued response to the same command is left over from a time-out
+  int index;
+  while ((index = findFrame(command)) >= 0)
+    removeFrame(index);
+
+  // Save this command, and when its response is due
+  _last_command = (nfc_command_t)command;
+  _sent_ms = millis();
+  _timeout = _timing.timeout(command);
+  _sent_us = micros();
+  _retries = 0;
+
+  // Build the frame, and hand it to the port in one call
+  if (len > SM130_MAX_DATA)
+    len = SM130_MAX_DATA;
+  _sent_length = SM130Frame<SM130UARTFraming>::build(_sent, command, data, len);
+  _nfc->write(_sent, _sent_length);
+  record(false, command, data, len);
+
+  // Selecting a tag ends the authenticated session, authenticating starts one
+  _session.sent(command, data, len);
+  return true;
+}
 
-  // Save this command
-  _last_command = command;
+/**************************************************************************/
+/*! 
+    @brief  Writes the last sent frame again if its command may be retried
 
-  // Init checksum (length + command )
-  uint8_t checksum = len + 1 + command;
+    @return true if the frame was written
+*/
+/**************************************************************************/
+template <class Port>
+bool NFCReaderT<Port>::retry() {
+  SM130CommandInfo info;
+  SM130Protocol::getCommandInfo(_last_command, &info);
+  if (!info.retry || _retries == SM130_MAX_RETRIES)
+    return false;
+
+  _retries++;
+  SM130_STAT(_stats.retries++);
+  _sent_ms = millis();
+  _nfc->write(_sent, _sent_length);
+  record(false, _last_command, _sent + 4, _sent_length - 5);
+  return true;
+}
 
-  // Write header
-  _nfc->write(0xFF);
+/**************************************************************************/
+/*! 
+    @brief  Records a packet in the trace, in the same format as the I2C
+            driver: length, command, data and checksum, without header
 
-  // Write reserved
-  _nfc->write((byte)0x00);
-  
-  // Write length
-  _nfc->write(len + 1);
+    @param  received  true for a packet received from the sm130
+    @param  command   Command byte
+    @param  data      Data bytes following the command
+    @param  len       Number of data bytes
+*/
+/**************************************************************************/
+template <class Port>
+void NFCReaderT<Port>::record(bool received, uint8_t command, const uint8_t *data, uint8_t len) {
+  if (_trace == 0)
+    return;
+  uint8_t packet[SM130Frame<SM130I2CFraming>::size(SM130_MAX_DATA)];
+  _trace->record(received, packet, SM130Frame<SM130I2CFraming>::build(packet, command, data, len));
+}
 
-  // Write command
-  _nfc->write(command);
+/**************************************************************************/
+/*! 
+    @brief  Feeds one received byte to the frame parser, and queues the
+            frame it completes. The parser resynchronizes on the next
+            frame after an error.
 
-  // Write each data bit
-  for(int i = 0; i < len; i++) {
-    checksum += data[i];
-    _nfc->write(data[i]);
+    @param  b  Byte received from the sm130
+    @return true if the byte completed a valid frame
+*/
+/**************************************************************************/
+template <class Port>
+bool NFCReaderT<Port>::parse(uint8_t b) {
+  uint8_t result = _parser.parse(b);
+  if (result == _parser.FRAME_ERROR) {
+    SM130_STAT(_stats.checksumErrors++);
+    return false;
   }
+  if (result != _parser.FRAME_COMPLETE)
+    return false;
+  record(true, _parser.command, _parser.data, _parser.length);
 
-  // Send up checksum
-  _nfc->write(checksum);
+  // a seek answers again when it finds a tag, also after other commands were sent
+  if (_parser.command != _last_command && _parser.command != NFC_SEEK) {
+    SM130_STAT(_stats.wrongCommands++);
+  }
 
-  delay(STANDARD_DELAY);
+  // queue the frame, dropping the oldest one if the queue is full
+  if (_frame_count == NFC_FRAME_QUEUE)
+    removeFrame(0);
+  nfc_frame_t &frame = _frames[_frame_count++];
+  frame.command = _parser.command;
+  frame.length = _parser.length;
+  memcpy(frame.data, _parser.data, _parser.length);
+  return true;
 }
 
 /**************************************************************************/
 /*! 
-    @brief  Function for receiving raw data from sm130 over UART
+    @brief  Reads all bytes received so far into the frame parser, without
+            blocking
 
-    @param  data  Buffer to store response from server into
+    @return the number of complete frames waiting
+*/
+/**************************************************************************/
+template <class Port>
+uint8_t NFCReaderT<Port>::poll() {
+  // one call to available() per batch of received bytes
+  for (int n; (n = _nfc->available()) > 0; ) {
+    while (n-- > 0)
+      parse(_nfc->read());
+  }
+  return _frame_count;
+}
+
+/**************************************************************************/
+/*! 
+    @brief  Returns the oldest complete frame, valid until it is dropped or
+            poll() is called. The view is empty if no frame is waiting.
+*/
+/**************************************************************************/
+template <class Port>
+SM130ResponseView NFCReaderT<Port>::frame() {
+  if (_frame_count == 0)
+    return SM130ResponseView();
+  return SM130ResponseView(_frames[0].command, _frames[0].data, _frames[0].length);
+}
+
+/**************************************************************************/
+/*! 
+    @brief  Drops the oldest complete frame
 */
 /**************************************************************************/
-uint8_t NFCReader::receive(uint8_t *data, int dataLen) {
+template <class Port>
+void NFCReaderT<Port>::dropFrame() {
+  if (_frame_count > 0)
+    removeFrame(0);
+}
 
-  // Initialize the checksum
-  uint8_t checksum = 0;
+/**************************************************************************/
+/*! 
+    @brief  Removes a frame from the queue
 
-  // wait for data.
-  while (!_nfc->available()) ;
+    @param  index  Position in the queue, 0 is the oldest
+*/
+/**************************************************************************/
+template <class Port>
+void NFCReaderT<Port>::removeFrame(uint8_t index) {
+  _frame_count--;
+  for (uint8_t i = index; i < _frame_count; i++)
+    _frames[i] = _frames[i + 1];
+}
 
-  // Wait until we get the header byte
-  while (_nfc->available()) {
-    if (_nfc->read() == 0xFF)
-      break;
+/**************************************************************************/
+/*! 
+    @brief  Returns the position in the queue of the oldest frame for a
+            command, or -1 if there is none
+
+    @param  command  Command the frame responds to
+*/
+/**************************************************************************/
+template <class Port>
+int NFCReaderT<Port>::findFrame(uint8_t command) {
+  for (uint8_t i = 0; i < _frame_count; i++) {
+    if (_frames[i].command == command)
+      return i;
   }
+  return -1;
+}
 
-  // If the next byte isn't reserved, something is wrong
-  if(_nfc->read() != 0x00) {
-    return -1;
+/**************************************************************************/
+/*! 
+    @brief  Function for receiving raw data from sm130 over UART. Returns as
+            soon as a complete frame for the last command is received, or
+            its response timed out. A command that may be retried is sent
+            again up to SM130_MAX_RETRIES times after a time-out, which
+            also covers a frame dropped for a bad checksum. Frames for
+            other commands stay queued.
+
+    @param  data  Buffer to store response from server into
+    @return length of the frame including the command byte, or -1
+*/
+/**************************************************************************/
+template <class Port>
+uint8_t NFCReaderT<Port>::receive(uint8_t *data, int dataLen) {
+  int index;
+  while ((index = findFrame(_last_command)) < 0) {
+    if (_timeout && millis() - _sent_ms > _timeout) {
+      SM130_STAT(_stats.timeouts++);
+      if (!retry()) {
+        _session.end();
+        return -1;
+      }
+    }
+    poll();
   }
-  
-  // Read the length byte
-  int len = _nfc->read();
-  
-  // input buffer not large enough.
-  if (dataLen < (len-1)) 
-	  return -1;
-  
-  // Add that to the checksum
-  checksum += len;
 
-  // Read the command we're responding to
-  int command_in = _nfc->read();
+  nfc_frame_t& frame = _frames[index];
+  uint8_t len = frame.length + 1;
 
-  // Add that to the checksum
-  checksum += command_in;
+  // a failed command ends the authenticated session
+  _session.received(frame.command, SM130Protocol::errorOf(frame.command, frame.data, frame.length));
 
-  // If it's not for the command we requested, return
-  if(command_in != _last_command)
+  // input buffer not large enough.
+  if (dataLen < frame.length) {
+    removeFrame(index);
     return -1;
-
-  // Grab all the data bytes
-  for(int i = 0; i < len - 1; i++) {
-    data[i] = _nfc->read();
-    checksum += data[i];
   }
 
-  // Confirm the checksum
-  int checksum_in = _nfc->read();
-  if(checksum_in != checksum)
-    return -1;
+  memcpy(data, frame.data, frame.length);
+  removeFrame(index);
+
+  // learn from responses to commands sent once that were waited for, a
+  // late seek response tells nothing
+  if (_timeout && _retries == 0)
+    _timing.record(_last_command, micros() - _sent_us, false);
+  SM130_STAT(_stats.record(_last_command, micros() - _sent_us));
   
   return len;
 }
 
+/**************************************************************************/
+/*! 
+    @brief  Receives the response to a command for the protocol core
+
+    @param  command  Command that was sent
+    @param  data     Buffer for the data bytes of the response
+    @param  size     Size of the buffer
+    @return the number of data bytes, or 0xFF if no response came
+*/
+/**************************************************************************/
+template <class Port>
+uint8_t NFCReaderT<Port>::receive(uint8_t command, uint8_t *data, uint8_t size) {
+  if (command != _last_command)
+    return 0xFF;
+  uint8_t len = receive(data, size);
+  return len == 0xFF ? 0xFF : len - 1;
+}
+
 /**************************************************************************/
 /*! 
     @brief  Begins communicating on a UART channel
 */
 /**************************************************************************/
-void NFCReader::setSerial(Stream &serial) {
+template <class Port>
+void NFCReaderT<Port>::setSerial(Port &serial) {
 
   _nfc = &serial;
 }
 
+/**************************************************************************/
+/*! 
+    @brief  Sets the function that switches the host side of the UART to
+            another baud rate, required for setBaudRate()
+
+    @param  callback  Switches the host UART to a baud rate
+    @param  baud      Current baud rate of the module and host
+*/
+/**************************************************************************/
+template <class Port>
+void NFCReaderT<Port>::setBaudCallback(nfc_baud_callback_t callback, unsigned long baud) {
+  _baud_callback = callback;
+  _baud = baud;
+}
+
+/**************************************************************************/
+/*! 
+    @brief  Returns the SET_BAUD_RATE code of a baud rate, or -1 if the
+            module doesn't support the rate
+*/
+/**************************************************************************/
+template <class Port>
+int NFCReaderT<Port>::baudCode(unsigned long baud) {
+  for (uint8_t i = 0; i < sizeof(nfc_baud_rates) / sizeof(nfc_baud_rates[0]); i++) {
+    if (nfc_baud_rates[i] == baud)
+      return i;
+  }
+  return -1;
+}
+
+/**************************************************************************/
+/*! 
+    @brief  Discards received bytes and frames, e.g. after a baud rate change
+*/
+/**************************************************************************/
+template <class Port>
+void NFCReaderT<Port>::flushInput() {
+  while (_nfc->available())
+    _nfc->read();
+  _parser.reset();
+  _frame_count = 0;
+}
+
+/**************************************************************************/
+/*! 
+    @brief  Sends SET_BAUD_RATE, and switches the host when the module
+            accepted the new rate. The module answers at the old rate.
+
+    @param  code  SET_BAUD_RATE code of the new rate
+    @return status of the module, 0x4C 'L' if it switched
+*/
+/**************************************************************************/
+template <class Port>
+uint8_t NFCReaderT<Port>::switchBaudRate(uint8_t code) {
+  send(NFC_SET_BAUD_RATE, &code, 1);
+
+  uint8_t response[1];
+  int len = receive(response, sizeof(response));
+  // length includes command byte.
+  if (len != 2) {
+    return 0xFF;
+  }
+  if (response[0] != STATUS_BAUD_CHANGED) {
+    return response[0];
+  }
+
+  _nfc->flush();
+  _baud_callback(nfc_baud_rates[code]);
+  _baud = nfc_baud_rates[code];
+  flushInput();
+  return response[0];
+}
+
+/**************************************************************************/
+/*! 
+    @brief  Switches the module and host to another baud rate. The firmware
+            version is read at the new rate to verify the link. If that
+            fails, the module is asked to go back to the previous rate.
+            The module keeps its baud rate after a reset.
+
+    @param  baud  New baud rate: 9600, 19200, 38400, 57600 or 115200
+    @return 0x4C 'L' on success, 0x4E 'N' if the rate is not supported or
+            no callback is set, 0xFF if the module didn't respond or the
+            link failed at the new rate
+*/
+/**************************************************************************/
+template <class Port>
+uint8_t NFCReaderT<Port>::setBaudRate(unsigned long baud) {
+  int code = baudCode(baud);
+  if (code < 0 || _baud_callback == 0) {
+    return STATUS_BAUD_FAILED;
+  }
+  if (baud == _baud) {
+    return STATUS_BAUD_CHANGED;
+  }
+
+  unsigned long previous = _baud;
+  uint8_t status = switchBaudRate(code);
+  if (status != STATUS_BAUD_CHANGED) {
+    return status;
+  }
+
+  // verify the link at the new rate
+  uint8_t version[NFC_MAX_DATA];
+  if (getFirmwareVersion(version, sizeof(version)) != 0xFF) {
+    return STATUS_BAUD_CHANGED;
+  }
+
+  // fall back, the module may not have switched, or the link doesn't work at the new rate
+  if (switchBaudRate(baudCode(previous)) != STATUS_BAUD_CHANGED) {
+    _nfc->flush();
+    _baud_callback(previous);
+    _baud = previous;
+    flushInput();
+  }
+  getFirmwareVersion(version, sizeof(version));
+  return 0xFF;
+}
+
+/**************************************************************************/
+/*! 
+    @brief  Switches to the highest baud rate supported by the module and
+            the link, trying rates from maxBaud down
+
+    @param  maxBaud  Highest baud rate the host supports
+    @return the baud rate in use
+*/
+/**************************************************************************/
+template <class Port>
+unsigned long NFCReaderT<Port>::negotiateBaudRate(unsigned long maxBaud) {
+  for (int i = sizeof(nfc_baud_rates) / sizeof(nfc_baud_rates[0]) - 1; i >= 0; i--) {
+    if (nfc_baud_rates[i] > maxBaud)
+      continue;
+    if (nfc_baud_rates[i] == _baud || setBaudRate(nfc_baud_rates[i]) == STATUS_BAUD_CHANGED)
+      break;
+  }
+  return _baud;
+}
+
 /**************************************************************************/
 /*! 
     @brief  Returns whether or not the UART connection is available
 */
 /**************************************************************************/
-uint8_t NFCReader::available() {
+template <class Port>
+uint8_t NFCReaderT<Port>::available() {
   return _nfc->available();
 }
 
@@ -159,12 +479,17 @@ uint8_t NFCReader::available() {
     @brief  Performs a software reset on the device
 */
 /**************************************************************************/
-void NFCReader::reset() {
+template <class Port>
+void NFCReaderT<Port>::reset() {
+  // Forget partial and queued frames
+  flushInput();
+
   // Write the reset command
   send(NFC_RESET, 0, 0);
 
-  // Wait a bit for safety
-  delay(STANDARD_DELAY);
+  // Wait until the module is back, it responds with the firmware version
+  uint8_t version[16];
+  receive(version, sizeof(version));
 }
 
 /**************************************************************************/
@@ -172,16 +497,14 @@ void NFCReader::reset() {
     @brief  Returns the components of the firmware in an int32_t
 */
 /**************************************************************************/
-  uint8_t NFCReader::getFirmwareVersion(uint8_t *versionString, int dataLen) {
+template <class Port>
+  uint8_t NFCReaderT<Port>::getFirmwareVersion(uint8_t *versionString, int dataLen) {
 
   uint32_t response;
 
   // Write the command to get firmware
   send(NFC_GET_FIRMWARE, 0, 0);
 
-  // Delay for processing safety
-  delay(STANDARD_DELAY);
-
   memset(versionString, '\0', dataLen);
   return receive(versionString, dataLen);
 }
@@ -193,29 +516,9 @@ void NFCReader::reset() {
 			 authenticate again. 
 */
 /**************************************************************************/
-uint8_t NFCReader::authenticate(uint8_t blockNumber, uint8_t keyType, uint8_t* key) {
-  uint8_t authData[8];
-  authData[0] = blockNumber;
-  authData[1] = keyType;
-  // keys are 6 bytes
-  for(int i = 0; i < 6; i++) {
-	  authData[i + 2] = key[i];
-  }
-	  
-  send(NFC_AUTHENTICATE, authData, sizeof(authData));
-  
-  delay(STANDARD_DELAY);
-  
-  int responseLen = 1;
-  uint8_t response[responseLen];
-  memset(response, '\0', responseLen);
-  int len = receive(response, responseLen);
-  // length includes command byte.
-  if (len == 2) {
-	  return response[0];
-  }
-  
-  return 0xFF;
+template <class Port>
+uint8_t NFCReaderT<Port>::authenticate(uint8_t blockNumber, uint8_t keyType, uint8_t* key) {
+  return Core::authenticate(*this, blockNumber, keyType, key);
 }
   
 /**************************************************************************/
@@ -225,22 +528,22 @@ uint8_t NFCReader::authenticate(uint8_t blockNumber, uint8_t keyType, uint8_t* k
 			fail. 
 */
 /**************************************************************************/  
-uint8_t NFCReader::readBlock(uint8_t blockNumber, uint8_t *blockData) {
+template <class Port>
+uint8_t NFCReaderT<Port>::readBlock(uint8_t blockNumber, uint8_t *blockData) {
+  // response is blockNumber (1 byte) + blockData (16 bytes), or an error code
+  memset(blockData, '\0', 17);
+  return Core::readBlock(*this, blockNumber, blockData);
+}
 
-  int responseLen = 17; // max of 17 bytes, if error will response will be 1 byte.
-  memset(blockData, '\0', responseLen);
-  
-  send(NFC_READ_BLOCK, &blockNumber, 1);
-  delay(STANDARD_DELAY);
-  
-  // response is blockNumber (1 byte) + blockData (16 bytes)
-  int len = receive(blockData, responseLen);
-  // length includes command byte.
-  if (len == 2) { // 2 bytes is an error (command byte + error code)
-	  return blockData[0]; 
-  }
-  
-  return 0x01;
+/**************************************************************************/
+/*! 
+    @brief  reads consecutive 16-byte blocks of a Mifare 1K/4K tag,
+            authenticating once per sector
+*/
+/**************************************************************************/
+template <class Port>
+unsigned int NFCReaderT<Port>::readBlocks(uint8_t first, unsigned int count, uint8_t *buffer, uint8_t keyType, uint8_t *key) {
+  return Core::readBlocks(*this, first, count, buffer, keyType, key);
 }
 
 /**************************************************************************/
@@ -250,45 +553,140 @@ uint8_t NFCReader::readBlock(uint8_t blockNumber, uint8_t *blockData) {
 			command will fail. Also, this command will fail if the block is not in valid Value format.  
 */
 /**************************************************************************/  
-uint8_t NFCReader::readValueBlock(uint8_t blockNumber, int32_t *valueData) {
-  
-  send(NFC_READ_VALUE, &blockNumber, 1);
-  delay(STANDARD_DELAY);
+template <class Port>
+uint8_t NFCReaderT<Port>::readValueBlock(uint8_t blockNumber, int32_t *valueData) {
+  return Core::readValue(*this, blockNumber, valueData);
+}
 
-  int responseLen = 5; // max of 5 bytes (blockNumber + 4 byte value), if error will response will be 1 byte.  
-  uint8_t response[responseLen];
-  memset(response, '\0', responseLen);
-  
-  // response is blockNumber (1 byte) + blockData (16 bytes)
-  int len = receive(response, responseLen);
-  // length includes command byte.
-  if (len == 2) { // 2 bytes is an error (command byte + error code)
-	  return response[0]; 
-  }
-  else {
-	// return bytes are LSB -> MSB. Index 0, is LSB. Loop will add MSB, shift right, etc.
-    *valueData = 0;
-  
-	for(int i = 3; i >= 0; --i) {
-	  *valueData <<= 8;
-	  *valueData |= (response[i] & 0xFF);
-	}
-  }
-  
-  return 0x01;	
+/**************************************************************************/
+/*! 
+    @brief  writes 16 bytes to the specified block. Before executing this
+            command, the particular block should be authenticated.
+*/
+/**************************************************************************/
+template <class Port>
+uint8_t NFCReaderT<Port>::writeBlock(uint8_t blockNumber, const uint8_t *blockData) {
+  uint8_t response[17];
+  return Core::write(*this, NFC_WRITE_BLOCK, blockNumber, blockData, response);
 }
 
-/*
-void halt()
-{
- //Halt tag
-  rfid.write((uint8_t)255);
-  rfid.write((uint8_t)0);
-  rfid.write((uint8_t)1);
-  rfid.write((uint8_t)147);
-  rfid.write((uint8_t)148);
+/**************************************************************************/
+/*! 
+    @brief  writes a value block. Before executing this command, the block
+            should be authenticated.
+*/
+/**************************************************************************/
+template <class Port>
+uint8_t NFCReaderT<Port>::writeValueBlock(uint8_t blockNumber, int32_t value) {
+  uint8_t data[4], response[5];
+  SM130Protocol::putValue(data, value);
+  return Core::write(*this, NFC_WRITE_VALUE, blockNumber, data, response);
+}
+
+/**************************************************************************/
+/*! 
+    @brief  writes 4 bytes to a Mifare Ultralight page
+*/
+/**************************************************************************/
+template <class Port>
+uint8_t NFCReaderT<Port>::writeUltralightPage(uint8_t page, const uint8_t *pageData) {
+  uint8_t response[5];
+  return Core::write(*this, NFC_WRITE_ULTRALIGHT, page, pageData, response);
+}
+
+/**************************************************************************/
+/*! 
+    @brief  adds to a value block. Before executing this command, the block
+            should be authenticated.
+*/
+/**************************************************************************/
+template <class Port>
+uint8_t NFCReaderT<Port>::increment(uint8_t blockNumber, int32_t delta, int32_t *newValue) {
+  return Core::changeValue(*this, NFC_INCREMENT, blockNumber, delta, newValue);
 }
+
+/**************************************************************************/
+/*! 
+    @brief  subtracts from a value block. Before executing this command, the
+            block should be authenticated.
 */
+/**************************************************************************/
+template <class Port>
+uint8_t NFCReaderT<Port>::decrement(uint8_t blockNumber, int32_t delta, int32_t *newValue) {
+  return Core::changeValue(*this, NFC_DECREMENT, blockNumber, delta, newValue);
+}
+
+/**************************************************************************/
+/*! 
+    @brief  changes a value block in one transaction. The sector is
+            authenticated unless it already is, the balance is read and
+            checked if one is expected, then the value is changed. The
+            response to the change holds the value read back, so verifying
+            it takes no extra command.
+
+    @param  command      NFC_INCREMENT or NFC_DECREMENT
+    @param  blockNumber  Value block
+    @param  delta        Amount to add or subtract
+    @param  expected     Balance before the change, or SM130_ANY_BALANCE
+    @param  keyType      Key type, 0xFF for the transport key
+    @param  key          Key (6 bytes)
+    @param  balance      Destination for the balance, or 0
+*/
+/**************************************************************************/
+template <class Port>
+uint8_t NFCReaderT<Port>::transact(uint8_t command, uint8_t blockNumber, int32_t delta, int32_t expected, uint8_t keyType, uint8_t *key, int32_t *balance) {
+  return Core::transact(*this, command, blockNumber, delta, expected, keyType, key, balance);
+}
+
+/**************************************************************************/
+/*! 
+    @brief  executes the writes of a batch on the selected tag, with one
+            authentication per sector. Writes to a sector are executed in
+            the order they were added, sectors in order of their first write.
+            Mifare Ultralight pages need no authentication.
+*/
+/**************************************************************************/
+template <class Port>
+uint8_t NFCReaderT<Port>::execute(NFCWriteBatch &batch, uint8_t keyType, uint8_t *key) {
+  return Core::execute(*this, batch, keyType, key);
+}
+
+/**************************************************************************/
+/*! 
+    @brief  Reads the whole memory of the tag in the field, passing each
+            block to a sink as soon as it is read
+
+    @param  sink     Function receiving each block, returns false to stop
+    @param  keyType  Key type for Mifare 1K/4K, 0xFF for the transport key
+    @param  key      Key (6 bytes), ignored for the transport key
+    @return the number of blocks passed to sink. The dump stops at the
+            first block that fails to authenticate or read, including a
+            response that never came, so the count is then short.
+*/
+/**************************************************************************/
+template <class Port>
+unsigned int NFCReaderT<Port>::dumpCard(SM130DumpSink sink, uint8_t keyType, uint8_t *key) {
+  return Core::dumpCard(*this, sink, keyType, key);
+}
+
+/**************************************************************************/
+/*! 
+    @brief  Halts the selected tag, which ends the authenticated session
+*/
+/**************************************************************************/
+template <class Port>
+uint8_t NFCReaderT<Port>::haltTag() {
+  send(NFC_HALT, 0, 0);
+
+  uint8_t response[1];
+  int len = receive(response, sizeof(response));
+  // length includes command byte.
+  if (len == 2) {
+    return response[0];
+  }
+
+  return 0xFF;
+}
 
 /**************************************************************************/
 /*! 
@@ -298,19 +696,17 @@ void halt()
     @param  length   Length in bytes
 */
 /**************************************************************************/
-uint8_t NFCReader::waitForTagID(uint8_t *uid, uint8_t *length) {
+template <class Port>
+uint8_t NFCReaderT<Port>::waitForTagID(uint8_t *uid, uint8_t *length) {
 
   // Write the command to select next tag in field
   send(NFC_SEEK, 0, 0);
 
-  // Delay for processing safety
-  delay(STANDARD_DELAY);
-
   // Get the response
   uint8_t retVal = receive_tag(uid, length);
   if (retVal == 0x4C) { // STATUS_NO_TAG
-	delay(STANDARD_DELAY);
-	// wait for the tag present.
+	// wait for the tag present, without time-out.
+	_timeout = 0;
 	retVal = receive_tag(uid, length);
   }
   
@@ -325,38 +721,116 @@ uint8_t NFCReader::waitForTagID(uint8_t *uid, uint8_t *length) {
     @param  length   Length in bytes
 */
 /**************************************************************************/
-uint8_t NFCReader::readTagID(uint8_t *uid, uint8_t *length) {
+template <class Port>
+uint8_t NFCReaderT<Port>::readTagID(uint8_t *uid, uint8_t *length) {
 
   // Write the command to select next tag in field
   send(NFC_SELECT, 0, 0);
 
-  // Delay for processing safety
-  delay(STANDARD_DELAY);
-
   // Get the response
   return receive_tag(uid, length);
 }
 
+/**************************************************************************/
+/*! 
+    @brief  Starts continuous seek
+
+    @param  callback  Called from update() for each tag found
+*/
+/**************************************************************************/
+template <class Port>
+void NFCReaderT<Port>::startSeek(nfc_tag_callback_t callback) {
+  _tag_callback = callback;
+  _seek_state = SEEK_DONE;
+  update();
+}
+
+/**************************************************************************/
+/*! 
+    @brief  Stops continuous seek. The module keeps seeking until the next
+            command is sent, a tag it finds is ignored.
+*/
+/**************************************************************************/
+template <class Port>
+void NFCReaderT<Port>::stopSeek() {
+  _seek_state = SEEK_OFF;
+}
+
+/**************************************************************************/
+/*! 
+    @brief  Processes received frames without blocking. In continuous seek
+            mode, seek responses are reported to the callback, and a new
+            seek is sent when the previous one found a tag, was cancelled
+            by another command, or wasn't acknowledged in time.
+
+    @return the number of tags reported
+*/
+/**************************************************************************/
+template <class Port>
+uint8_t NFCReaderT<Port>::update() {
+  uint8_t tags = 0;
+  poll();
+
+  int index;
+  while (_seek_state != SEEK_OFF && (index = findFrame(NFC_SEEK)) >= 0) {
+    nfc_frame_t& frame = _frames[index];
+
+    // status: 'L' seek in progress, 'U' RF field off
+    if (frame.length == 1) {
+      if (frame.data[0] == STATUS_IN_PROGRESS)
+        _seek_state = SEEK_ARMED;
+      else if (frame.data[0] == STATUS_RF_OFF)
+        _seek_state = SEEK_OFF;
+      removeFrame(index);
+      continue;
+    }
+
+    // tag type and tag number, the seek is done
+    if (frame.length < 2 || frame.length > sizeof(_tag)) {
+      removeFrame(index);
+      continue;
+    }
+    memcpy(_tag, frame.data, frame.length);
+    _tag_length = frame.length - 1;
+    removeFrame(index);
+
+    _seek_state = SEEK_DONE;
+    tags++;
+    if (_tag_callback)
+      _tag_callback(getTag());
+  }
+
+  // re-arm, after the time-out of the seek descriptor if it wasn't
+  // acknowledged: _timeout may be 0 after waitForTagID()
+  SM130CommandInfo info;
+  SM130Protocol::getCommandInfo(NFC_SEEK, &info);
+  if (_seek_state != SEEK_OFF && (_seek_state == SEEK_DONE || _last_command != NFC_SEEK ||
+      (_seek_state == SEEK_SENT && millis() - _sent_ms > info.timeout))) {
+    send(NFC_SEEK, 0, 0);
+    _seek_state = SEEK_SENT;
+  }
+
+  return tags;
+}
+
 /**************************************************************************/
 /*! 
     @brief  Helper function to accepts a tag and returns the UUID and 
-            length of the UUID
+            length of the UUID. The response stays in _tag for getTag().
 
-    @param  uid      Pointer a buffer that will have the uuid stored into it
+    @param  uid      Pointer a buffer that will have the uuid stored into it,
+                     or 0 to only use getTag()
     @param  length   Length in bytes
 */
 /**************************************************************************/
-uint8_t NFCReader::receive_tag(uint8_t *uid, uint8_t *length) {
+template <class Port>
+uint8_t NFCReaderT<Port>::receive_tag(uint8_t *uid, uint8_t *length) {
 
-  // Clear out the packet buffer for safety
-  memset(sm130_packetbuffer, '\0', sm130_PACKBUFFSIZE);
+  // Forget the previous tag
+  _tag_length = 0;
 
   // Grab the response from the adapter
-  uint8_t len = receive(sm130_packetbuffer, sm130_PACKBUFFSIZE);
-
-  //Serial.print("Length is: ");
-  //Serial.println(len);
-  //PrintHex(sm130_packetbuffer, sm130_PACKBUFFSIZE);
+  uint8_t len = receive(_tag, sizeof(_tag));
   
   // There seems to be a bug where only several tags will
   // be sent back unless we reset everytime. 
@@ -376,18 +850,19 @@ uint8_t NFCReader::receive_tag(uint8_t *uid, uint8_t *length) {
   // Else, parse the tag info 
   else {
 
-    // // The size is the rest of the packet
-    *length = len - 1;
-
-	// error code
-	if (*length == 1) {
-		return sm130_packetbuffer[0];
+	// error code (command byte + error code)
+	if (len == 2) {
+		*length = 0;
+		return _tag[0];
 	}
 
-    // Copy the UUID into the buffer
-    for (int i = 0; i < *length; i++) {
+    // The size is the rest of the packet, after the command and tag type
+    _tag_length = len - 2;
+    *length = _tag_length;
 
-      uid[i] = sm130_packetbuffer[i + 1];
+    // Copy the UUID into the buffer
+    if (uid) {
+      memcpy(uid, _tag + 1, _tag_length);
     }
 
     // Return success
@@ -405,7 +880,8 @@ uint8_t NFCReader::receive_tag(uint8_t *uid, uint8_t *length) {
     @param  numBytes  Data length in bytes
 */
 /**************************************************************************/
-void NFCReader::PrintHex(const byte * data, const uint32_t numBytes)
+template <class Port>
+void NFCReaderT<Port>::PrintHex(const byte * data, const uint32_t numBytes)
 {
   uint32_t szPos;
   for (szPos=0; szPos < numBytes; szPos++) 
@@ -423,4 +899,6 @@ void NFCReader::PrintHex(const byte * data, const uint32_t numBytes)
   Serial.println("");
 }
 
-
+// The readers built into the library: on any Stream, and on a BufferedSerial
+template class NFCReaderT<Stream>;
+template class NFCReaderT<BufferedSerial>;
@@ -7,8 +7,17 @@
   #include "WProgram.h"
   #endif
 #include <inttypes.h>
+#include <sm130core.h>
+#include <sm130stats.h>
+#include <sm130trace.h>
+#include <sm130timing.h>
+#include <sm130view.h>
 
-#define STANDARD_DELAY 100
+#define NFC_TIMEOUT SM130_TIMEOUT // time-out (ms) for a response frame
+#define NFC_TIMEOUT_WRITE SM130_TIMEOUT_WRITE // time-out (ms) for the response to a write command
+#define NFC_TIMEOUT_RESET SM130_TIMEOUT_RESET // time-out (ms) for the response to a reset
+#define NFC_MAX_DATA SM130_MAX_DATA // maximum number of data bytes in a response frame
+#define NFC_FRAME_QUEUE 3 // maximum number of complete frames waiting
 
 // Format of send message:
 // Header   Reserved    Length   Command    Data       CSUM
@@ -24,25 +33,25 @@
 
 enum nfc_command_t {
   NFC_NONE = 0,
-  NFC_RESET = 0x80,
-  NFC_GET_FIRMWARE = 0x81,
-  NFC_SEEK = 0x82,
-  NFC_SELECT = 0x83,
-  NFC_AUTHENTICATE = 0x85,
-  NFC_READ_BLOCK = 0x86,
-  NFC_READ_VALUE = 0x87,
-  NFC_WRITE_BLOCK = 0x89,
-  NFC_WRITE_VALUE = 0x8A,
-  NFC_WRITE_ULTRALIGHT = 0x8B,
-  NFC_WRITE_KEY = 0x8C,
-  NFC_INCREMENT = 0x8D,
-  NFC_DECREMENT = 0x8E,
-  NFC_ANTENNA = 0x90,
-  NFC_READ_PORT = 0x91,
-  NFC_WRITE_PORT = 0x92,
-  NFC_HALT = 0x93,
-  NFC_SET_BAUD_RATE = 0x94,
-  NFC_SLEEP = 0x96,
+  NFC_RESET = SM130Protocol::CMD_RESET,
+  NFC_GET_FIRMWARE = SM130Protocol::CMD_VERSION,
+  NFC_SEEK = SM130Protocol::CMD_SEEK_TAG,
+  NFC_SELECT = SM130Protocol::CMD_SELECT_TAG,
+  NFC_AUTHENTICATE = SM130Protocol::CMD_AUTHENTICATE,
+  NFC_READ_BLOCK = SM130Protocol::CMD_READ16,
+  NFC_READ_VALUE = SM130Protocol::CMD_READ_VALUE,
+  NFC_WRITE_BLOCK = SM130Protocol::CMD_WRITE16,
+  NFC_WRITE_VALUE = SM130Protocol::CMD_WRITE_VALUE,
+  NFC_WRITE_ULTRALIGHT = SM130Protocol::CMD_WRITE4,
+  NFC_WRITE_KEY = SM130Protocol::CMD_WRITE_KEY,
+  NFC_INCREMENT = SM130Protocol::CMD_INC_VALUE,
+  NFC_DECREMENT = SM130Protocol::CMD_DEC_VALUE,
+  NFC_ANTENNA = SM130Protocol::CMD_ANTENNA_POWER,
+  NFC_READ_PORT = SM130Protocol::CMD_READ_PORT,
+  NFC_WRITE_PORT = SM130Protocol::CMD_WRITE_PORT,
+  NFC_HALT = SM130Protocol::CMD_HALT_TAG,
+  NFC_SET_BAUD_RATE = SM130Protocol::CMD_SET_BAUD,
+  NFC_SLEEP = SM130Protocol::CMD_SLEEP,
 };
 
 enum status_code_t {
@@ -55,39 +64,179 @@ enum status_code_t {
   STATUS_NO_TAG = 0x4E,
   STATUS_RF_OFF = 0x55,
   STATUS_LOGIN_FAILED = 0x55,
+  STATUS_BAUD_CHANGED = 0x4C,
+  STATUS_BAUD_FAILED = 0x4E,
 };
 
-class NFCReader {
+// Called for each tag found in continuous seek mode. The view is valid until
+// the next tag is read.
+typedef SM130TagCallback nfc_tag_callback_t;
+
+// Switches the host side of the UART to a baud rate, e.g. Serial1.begin(baud)
+typedef void (*nfc_baud_callback_t)(unsigned long baud);
+
+// A received response frame
+struct nfc_frame_t {
+  uint8_t command;
+  uint8_t length; // number of data bytes
+  uint8_t data[NFC_MAX_DATA];
+};
+
+#define NFC_BATCH_SIZE SM130_BATCH_SIZE // maximum number of writes in a NFCWriteBatch
+
+// A write operation queued in a NFCWriteBatch
+typedef SM130Write nfc_write_t;
+
+// Several writes to one tag, executed back-to-back by NFCReader::execute()
+// with one authentication per sector. The add functions return false when
+// the batch is full.
+typedef SM130WriteBatch NFCWriteBatch;
+
+// Reader on a serial port. The port type is a template parameter, so poll()
+// reads a BufferedSerial, or any port class derived from Stream, without a
+// virtual call per byte when the class is final. NFCReader is the reader on
+// any Stream.
+template <class Port = Stream>
+class NFCReaderT {
 private:
-  Stream* _nfc;
+  Port* _nfc;
   nfc_command_t _last_command;
+  unsigned long _sent_ms;
+  unsigned long _timeout; // ms after _sent_ms the response is due, 0 to wait forever
+  unsigned long _sent_us; // time in microseconds the last command was sent
+  SM130Timing _timing;    // learned response times
+
+  // Last sent frame, written again when its response times out
+  uint8_t _sent[SM130Frame<SM130UARTFraming>::size(SM130_MAX_DATA)];
+  uint8_t _sent_length;
+  uint8_t _retries;
+
+  // Binary trace of sent and received packets, or 0
+  SM130Trace* _trace;
+
+  // Frame parser, fed one byte at a time by poll()
+  SM130Parser<SM130UARTFraming> _parser;
+
+  // Continuous seek
+  enum { SEEK_OFF, SEEK_SENT, SEEK_ARMED, SEEK_DONE };
+  uint8_t _seek_state;
+  nfc_tag_callback_t _tag_callback;
+
+  // Baud rate switching
+  nfc_baud_callback_t _baud_callback;
+  unsigned long _baud;
+
+  // Complete frames waiting to be received, oldest first
+  nfc_frame_t _frames[NFC_FRAME_QUEUE];
+  uint8_t _frame_count;
+
+  // Authenticated session, valid until a tag is (re)selected or a command fails
+  SM130Session _session;
+
+  // Last SEEK or SELECT response: tag type followed by the tag number
+  uint8_t _tag[8];
+  uint8_t _tag_length;
+
+#ifdef SM130_STATS
+  SM130Stats _stats;
+#endif
   
-  void send(nfc_command_t command, uint8_t *data, int len);
+  // Authentication, block reads and writes and write batches of the protocol core
+  typedef SM130Operations<NFCReaderT> Core;
+  friend struct SM130Operations<NFCReaderT>;
+
+  bool send(uint8_t command, const uint8_t *data, uint8_t len);
   uint8_t receive(uint8_t *data, int dataLen);
+  uint8_t receive(uint8_t command, uint8_t *data, uint8_t size);
+  bool retry();
+  void record(bool received, uint8_t command, const uint8_t *data, uint8_t len);
+  bool parse(uint8_t b);
+  void removeFrame(uint8_t index);
+  int findFrame(uint8_t command);
+  void flushInput();
+  uint8_t switchBaudRate(uint8_t code);
+  static int baudCode(unsigned long baud);
+  uint8_t transact(uint8_t command, uint8_t blockNumber, int32_t delta, int32_t expected, uint8_t keyType, uint8_t *key, int32_t *balance);
   uint8_t receive_tag(uint8_t *uid, uint8_t *length);
+  bool isAuthenticated(uint8_t blockNumber, uint8_t keyType, const uint8_t *key) { return _session.matches(blockNumber, keyType, key); }
   
 public:
 
   // Create a new NFC Reader
-  NFCReader();
+  NFCReaderT();
 
   // Begin communicating over UART (must be called);
-  void setSerial(Stream &serial);
+  void setSerial(Port &serial);
+
+  // Record every sent and received packet in a trace, or stop recording if
+  // trace is 0. The trace is drained by the caller, e.g. trace.drain(Serial),
+  // as the reader's own port may be Serial. Decode it with host/tracedump.
+  void setTrace(SM130Trace *trace) { _trace = trace; }
+
+  // Set the function that switches the host UART to another baud rate, and the
+  // rate the module and host currently use (the module's default is 19200)
+  void setBaudCallback(nfc_baud_callback_t callback, unsigned long baud = 19200);
+
+  // Switch the module and host to 9600, 19200, 38400, 57600 or 115200 baud.
+  // The link is verified at the new rate, and restored to the previous rate
+  // if that fails. The module keeps the rate after a reset.
+  // Returns:
+  // 0x4C 'L' - Baud rate changed
+  // 0x4E 'N' - Rate not supported, or no callback set
+  // 0xFF     - No response, or the link failed at the new rate
+  uint8_t setBaudRate(unsigned long baud);
+
+  // Switch to the highest rate up to maxBaud at which the link works.
+  // Returns the baud rate in use.
+  unsigned long negotiateBaudRate(unsigned long maxBaud = 115200);
+
+  // Returns the baud rate in use
+  unsigned long getBaudRate() { return _baud; }
 
   // Check if the adapter is available for commands
   uint8_t available();
+
+  // Read the bytes received so far into the frame parser, without blocking.
+  // Returns the number of complete frames waiting. Frames that don't answer the
+  // command being executed, e.g. a seek response arriving late, stay queued.
+  uint8_t poll();
+
+  // Oldest complete frame, valid until it is dropped or poll() is called
+  SM130ResponseView frame();
+
+  // Drop the oldest complete frame
+  void dropFrame();
   
   // Software reset on the RFID chip
   void reset();
 
+  // Halt the selected tag. Returns 0x4C 'L' on success, 0x55 'U' if the RF field is off
+  uint8_t haltTag();
+
   // Get the version of the firmware (generally a good test to see if UART is working)
   // firmware version is returned in versionString, length is the size of versionString
   uint8_t getFirmwareVersion(uint8_t *versionString, int dataLen);
 
   // Read a tag, first method waits for tag, second does not.
+  // Returns 1 on success, and copies the tag number into uid unless uid is 0.
   uint8_t waitForTagID(uint8_t *uid, uint8_t *length);
   uint8_t readTagID(uint8_t *uid, uint8_t *length);
 
+  // Continuous seek: keeps the reader seeking, and calls callback from update()
+  // for each tag found. Other commands can be executed in between, seeking
+  // resumes on the next update(). Stops when the RF field is off.
+  void startSeek(nfc_tag_callback_t callback);
+  void stopSeek();
+  bool isSeeking() { return _seek_state != SEEK_OFF; }
+
+  // Processes received frames without blocking and re-arms continuous seek.
+  // Call from loop(). Returns the number of tags reported to the callback.
+  uint8_t update();
+
+  // Tag number of the last successful waitForTagID(), readTagID() or continuous seek, without copying it.
+  // The view is valid until the next call of either function.
+  SM130TagView getTag() { return SM130TagView(_tag[0], _tag + 1, _tag_length); }
+
   // 
   //Key Type
   // 1 Byte – Option byte that instructs the module which type of key to be
@@ -99,12 +248,16 @@ public:
   //          SM13X module’s E2PROM (0 to 15)
   //          0x20 to 0x2F: Authenticate with Key type B using the key stored in the
   //          SM13X module’s E2PROM (0 to 15)
-  //          Key 6 Bytes – Key to be used for authentication. 
+  //          Key 6 Bytes – Key to be used for authentication with key type A or B.
+  //          A null key means the transport key. Stored keys take no key.
   // Returns:
   // 0x4C ‘L’ – Login Successful
   // 0x4E ‘N’ – No Tag present or Login Failed
   // 0x55 ‘U’ – Login Failed
   // 0x45 ‘E’ – Invalid key format in E2PROM 
+  // The authenticated sector is remembered, authenticating it again with the same
+  // key returns 0x4C without sending a command, until a tag is (re)selected or halted,
+  // or a command fails.
   uint8_t authenticate(uint8_t blockNumber, uint8_t keyType, uint8_t* key);
   
   // reads 16 bytes from the specified block. Before executing this command,
@@ -117,6 +270,19 @@ public:
   //  0x4E ‘N’ – No Tag present
   //  0x46 ‘F’ – Read Failed 
   uint8_t readBlock(uint8_t blockNumber, uint8_t *blockData);
+
+  // reads consecutive 16-byte blocks of a Mifare 1K/4K tag into buffer (16 bytes
+  // per block), authenticating once per sector. The read stops after block 255
+  // instead of wrapping around: count is clamped to 256 - first.
+  // Returns the number of blocks read, short if a command failed.
+  unsigned int readBlocks(uint8_t first, unsigned int count, uint8_t *buffer, uint8_t keyType = 0xFF, uint8_t *key = 0);
+
+  // reads all blocks of a Mifare 1K/4K sector, including the sector trailer, into
+  // buffer (64 bytes, 256 bytes for sectors 32-39).
+  // Returns the number of blocks read.
+  unsigned int readSector(uint8_t sector, uint8_t *buffer, uint8_t keyType = 0xFF, uint8_t *key = 0) {
+    return readBlocks(SM130Protocol::firstBlockOf(sector), SM130Protocol::blocksInSector(sector), buffer, keyType, key);
+  }
   
   //  reads a value block. Value is a 4byte signed integer. Before executing this
   //  command, the block should be authenticated. If the block is not authenticated, this
@@ -128,8 +294,95 @@ public:
   //  0x46 ‘F’ – Read Failed 
   uint8_t readValueBlock(uint8_t blockNumber, int32_t *valueData);
   
+  // writes 16 bytes to the specified block. Before executing this command, the
+  // particular block should be authenticated. Block 0 can't be written.
+  // Note: When writing a Mifare UL tag, only the first 4 bytes are written to the page,
+  // and the write is unverified unless the next pages hold the other 12 bytes.
+  // Returns:
+  //  returns 0x01 on success.
+  //  0x4E 'N' - No Tag present
+  //  0x46 'F' - Write Failed
+  //  0x55 'U' - Read after write failed
+  //  0x58 'X' - Unable to Read after write
+  //  0x56 'V' - Block or data read after write differ from those written
+  uint8_t writeBlock(uint8_t blockNumber, const uint8_t *blockData);
+
+  // writes a value block, the module formats the block with the value, its
+  // complement and the block address. The block should be authenticated.
+  // Returns:
+  //  returns 0x01 on success.
+  //  0x4E 'N' - No Tag present
+  //  0x46 'F' - Write Failed
+  //  0x49 'I' - Invalid Value Block
+  //  0x56 'V' - Block or value read after write differ from those written
+  uint8_t writeValueBlock(uint8_t blockNumber, int32_t value);
+
+  // writes 4 bytes to a Mifare Ultralight page (2 to 15).
+  // Returns:
+  //  returns 0x01 on success.
+  //  0x4E 'N' - No Tag present
+  //  0x46 'F' - Write Failed
+  //  0x56 'V' - Page or data read after write differ from those written
+  uint8_t writeUltralightPage(uint8_t page, const uint8_t *pageData);
+
+  // adds to or subtracts from a value block. The block should be authenticated.
+  // The new value is returned in newValue, unless it is 0.
+  // Returns:
+  //  returns 0x01 on success.
+  //  0x4E 'N' - No Tag present
+  //  0x46 'F' - Failed
+  //  0x49 'I' - Invalid Value Block
+  //  0x56 'V' - Response is for another block
+  uint8_t increment(uint8_t blockNumber, int32_t delta, int32_t *newValue = 0);
+  uint8_t decrement(uint8_t blockNumber, int32_t delta, int32_t *newValue = 0);
+
+  // subtracts from or adds to a value block in one transaction: authenticates
+  // the sector unless it already is, checks the balance unless expected is
+  // SM130_ANY_BALANCE, changes the value and verifies the value read back.
+  // The balance is returned in balance, unless it is 0: after the change, or
+  // as read on a mismatch.
+  // Returns:
+  //  0x01 'SM130_VALUE_DONE' - value changed
+  //  0x4D 'SM130_VALUE_MISMATCH' - balance differs from expected, nothing changed
+  //  0x56 'SM130_VALUE_UNVERIFIED' - value read back differs from expected - amount
+  //  the error code of the failed authentication or value command, or 0xFF for no response
+  uint8_t debit(uint8_t blockNumber, int32_t amount, int32_t expected, uint8_t keyType, uint8_t *key, int32_t *balance = 0) {
+    return transact(NFC_DECREMENT, blockNumber, amount, expected, keyType, key, balance);
+  }
+  uint8_t credit(uint8_t blockNumber, int32_t amount, int32_t expected, uint8_t keyType, uint8_t *key, int32_t *balance = 0) {
+    return transact(NFC_INCREMENT, blockNumber, amount, expected, keyType, key, balance);
+  }
+
+  // executes the writes of a batch on the selected tag. Writes to the same sector
+  // are executed in order after one authentication, sectors in order of their
+  // first write. Execution stops at the first failure, batch.failed() tells which.
+  // Returns 0x01 on success, 0x56 'V' if a write wasn't echoed, or the error code of
+  // the failed authentication or write.
+  uint8_t execute(NFCWriteBatch &batch, uint8_t keyType, uint8_t *key);
+
+  // reads the whole memory of the tag in the field, selecting it again to learn
+  // its type: 64 blocks for Mifare 1K, 256 for 4K, or 16 pages for Ultralight,
+  // four per read. Sectors are authenticated once. Each block is passed to sink
+  // as soon as it is read. Stops when a command fails or sink returns false.
+  // Returns the number of blocks passed to sink (4 for a whole Ultralight).
+  unsigned int dumpCard(SM130DumpSink sink, uint8_t keyType = 0xFF, uint8_t *key = 0);
+
+  // Returns the sector containing a block (Mifare 1K/4K)
+  static uint8_t sectorOf(uint8_t blockNumber) { return SM130Protocol::sectorOf(blockNumber); }
+
+  // Learned response times per command. Time-outs start from the datasheet
+  // defaults and follow the response times measured since.
+  SM130Timing& getTiming() { return _timing; }
+
+#ifdef SM130_STATS
+  // Command statistics: per-command latency, checksum errors and wrong responses
+  SM130Stats& getStats() { return _stats; }
+#endif
+
   // Print a value in hex with the '0x' appended at the front
   void PrintHex(const byte * data, const uint32_t numBytes);
 };
 
+typedef NFCReaderT<> NFCReader;
+
 #endif
\ No newline at end of file
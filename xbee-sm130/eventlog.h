@@ -0,0 +1,250 @@
+/**
+ * 	@file	eventlog.h
+ * 	@brief	EEPROM log of events waiting to be delivered
+ *
+ *	<p>
+ *	The log starts with a header identifying its format, followed by
+ *	fixed-size slots used as a ring, oldest first:
+ *	</p>
+ *	<pre>
+ *	header: 'E' 'L' version(1) slotSize(1)
+ *	slot:   state(1) sequence(2, LSB first) length(1) data(EVENT_LOG_DATA)
+ *	</pre>
+ *	<p>
+ *	Each event takes the slot after the last one, so every slot is written
+ *	once per trip around the ring rather than one slot wearing out. The
+ *	state is written last, and marked delivered in place, so no separate
+ *	index has to be kept: begin() finds the newest event by its sequence
+ *	number and the oldest undelivered one after it. When the log is full,
+ *	a new event replaces the oldest. EEPROM without a matching header, left
+ *	by another sketch or an older format, is formatted instead of replayed.
+ *	</p>
+ *	<p>
+ *	An EEPROM write takes 3.3 ms, so store() only queues the event in RAM
+ *	and service(), called from loop(), writes the queued events one byte at
+ *	a time.
+ *	</p>
+ */
+
+#ifndef EVENTLOG_h
+#define EVENTLOG_h
+
+#if defined(ARDUINO) && ARDUINO >= 100
+#include "Arduino.h"
+#else
+#include "WProgram.h"
+#endif
+#include <EEPROM.h>
+
+#define EVENT_LOG_DATA 48 // maximum event size
+#define EVENT_LOG_SLOT (EVENT_LOG_DATA + 4) // slot size with state, sequence and length
+#define EVENT_LOG_HEADER 4 // size of the format header
+#define EVENT_LOG_VERSION 1 // format version in the header
+#define EVENT_LOG_QUEUE 3 // events waiting in RAM to be written
+
+/**	Ring of events in EEPROM.
+ */
+class EventLog
+{
+	enum
+	{
+		EMPTY = 0xff, //!< erased, or being written
+		PENDING = 'P', //!< waiting to be delivered
+		DELIVERED = 0x00
+	};
+
+	//! Event waiting to be written, as it goes into its slot
+	struct Queued
+	{
+		uint8_t length; //!< bytes of the slot to write
+		uint8_t slot[EVENT_LOG_SLOT];
+	};
+
+	int start; //!< EEPROM address of the header
+	uint8_t slots; //!< number of slots
+	uint8_t head; //!< slot of the next event
+	uint8_t tail; //!< slot of the oldest undelivered event
+	uint8_t count; //!< number of undelivered events written
+	uint16_t sequence; //!< sequence number of the next event
+
+	Queued queue[EVENT_LOG_QUEUE];
+	uint8_t queueHead; //!< index of the event being written
+	uint8_t queueCount; //!< number of events waiting to be written
+	uint8_t written; //!< bytes of the slot written so far
+
+	int address(uint8_t slot) { return start + EVENT_LOG_HEADER + slot * EVENT_LOG_SLOT; };
+	uint8_t next(uint8_t slot) { return slot + 1 == slots ? 0 : slot + 1; };
+	uint8_t state(uint8_t slot) { return EEPROM.read(address(slot)); };
+	uint16_t sequenceOf(uint8_t slot)
+	{
+		return EEPROM.read(address(slot) + 1) | (EEPROM.read(address(slot) + 2) << 8);
+	};
+
+	//! Returns true if the header matches this format
+	boolean formatted()
+	{
+		return EEPROM.read(start) == 'E' && EEPROM.read(start + 1) == 'L' &&
+			EEPROM.read(start + 2) == EVENT_LOG_VERSION && EEPROM.read(start + 3) == EVENT_LOG_SLOT;
+	};
+
+	//! Empty all slots and write the header
+	void format()
+	{
+		for (uint8_t i = 0; i < slots; i++)
+			EEPROM.update(address(i), EMPTY);
+		EEPROM.update(start, 'E');
+		EEPROM.update(start + 1, 'L');
+		EEPROM.update(start + 2, EVENT_LOG_VERSION);
+		EEPROM.update(start + 3, EVENT_LOG_SLOT);
+	};
+
+	//! Write the next byte of the oldest queued event
+	void writeNext()
+	{
+		Queued& event = queue[queueHead];
+		int a = address(head);
+		if (written == 0 && count == slots)
+		{
+			// full, lose the oldest event
+			tail = next(tail);
+			count--;
+		}
+		if (written < event.length)
+		{
+			EEPROM.update(a + written, event.slot[written]);
+			written++;
+			return;
+		}
+		EEPROM.update(a, PENDING);
+		if (count++ == 0)
+			tail = head;
+		head = next(head);
+		written = 0;
+		queueHead = (queueHead + 1) % EVENT_LOG_QUEUE;
+		queueCount--;
+	};
+
+public:
+	uint16_t dropped; //!< events not stored because the RAM queue was full
+
+	/**	Constructor.
+	 *
+	 *	@param start EEPROM address of the log
+	 *	@param size Bytes of EEPROM used, at least the header and one slot
+	 */
+	EventLog(int start, int size) : start(start), head(0), tail(0), count(0), sequence(0),
+		queueHead(0), queueCount(0), written(0), dropped(0)
+	{
+		int n = (size - EVENT_LOG_HEADER) / EVENT_LOG_SLOT;
+		slots = n > 255 ? 255 : n < 0 ? 0 : n;
+	};
+
+	/**	Find the events left in EEPROM, or format it if it doesn't hold a
+	 *	log. Call from setup().
+	 */
+	void begin()
+	{
+		head = tail = count = queueCount = written = 0;
+		sequence = 0;
+		if (slots == 0)
+			return;
+		if (!formatted())
+		{
+			format();
+			return;
+		}
+
+		// The newest event is the one not followed by its successor
+		for (uint8_t i = 0; i < slots; i++)
+		{
+			if (state(i) == EMPTY)
+				continue;
+			uint8_t j = next(i);
+			if (state(j) == EMPTY || sequenceOf(j) != (uint16_t)(sequenceOf(i) + 1))
+			{
+				head = j;
+				sequence = sequenceOf(i) + 1;
+				break;
+			}
+		}
+
+		// Undelivered events run from the oldest to the newest
+		for (uint8_t i = 0, j = head; i < slots; i++, j = next(j))
+		{
+			if (state(j) != PENDING)
+				count = 0;
+			else if (count++ == 0)
+				tail = j;
+		}
+	};
+
+	/**	Queue an event to be written by service().
+	 *
+	 *	@param data Event data
+	 *	@param length Length of the data, at most EVENT_LOG_DATA
+	 *	@return false if the event is too long, or the queue is full
+	 */
+	boolean store(const uint8_t* data, uint8_t length)
+	{
+		if (length > EVENT_LOG_DATA || slots == 0)
+			return false;
+		if (queueCount == EVENT_LOG_QUEUE)
+		{
+			dropped++;
+			return false;
+		}
+		Queued& event = queue[(queueHead + queueCount++) % EVENT_LOG_QUEUE];
+		event.slot[0] = EMPTY; // not valid until completely written
+		event.slot[1] = sequence & 0xff;
+		event.slot[2] = sequence >> 8;
+		event.slot[3] = length;
+		memcpy(event.slot + 4, data, length);
+		event.length = length + 4;
+		sequence++;
+		return true;
+	};
+
+	//! Write a byte of the queued events. Call from loop().
+	void service()
+	{
+		if (queueCount != 0)
+			writeNext();
+	};
+
+	//! Returns the number of undelivered events, once written
+	uint8_t pending() { return count; };
+
+	/**	Read the oldest undelivered event.
+	 *
+	 *	@param data Set to the event data, at least EVENT_LOG_DATA bytes
+	 *	@param seq Set to the sequence number of the event
+	 *	@return the length of the event, 0 if all were delivered
+	 */
+	uint8_t peek(uint8_t* data, uint16_t* seq)
+	{
+		if (count == 0)
+			return 0;
+		int a = address(tail);
+		uint8_t n = EEPROM.read(a + 3);
+		for (uint8_t i = 0; i < n; i++)
+			data[i] = EEPROM.read(a + 4 + i);
+		*seq = sequenceOf(tail);
+		return n;
+	};
+
+	/**	Mark the oldest undelivered event delivered.
+	 *
+	 *	@param seq Sequence number of the event, from peek(). Nothing is
+	 *	marked if the event was replaced meanwhile.
+	 */
+	void remove(uint16_t seq)
+	{
+		if (count == 0 || sequenceOf(tail) != seq)
+			return;
+		EEPROM.update(address(tail), DELIVERED);
+		tail = next(tail);
+		count--;
+	};
+};
+
+#endif // EVENTLOG_h
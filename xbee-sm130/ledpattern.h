@@ -0,0 +1,87 @@
+/**
+ * 	@file	ledpattern.h
+ * 	@brief	Non-blocking LED flash patterns
+ *
+ *	<p>
+ *	A pattern flashes an LED a number of times, on and off for the same
+ *	time. Patterns are queued and played one after the other by service(),
+ *	called from loop(), which toggles the LED when its time has come
+ *	instead of waiting with delay().
+ *	</p>
+ */
+
+#ifndef LEDPATTERN_h
+#define LEDPATTERN_h
+
+#if defined(ARDUINO) && ARDUINO >= 100
+#include "Arduino.h"
+#else
+#include "WProgram.h"
+#endif
+
+#define LED_PATTERN_QUEUE 4 // patterns waiting to be played
+
+/**	Queue of flash patterns played on one LED.
+ */
+class LedPattern
+{
+	struct Flash
+	{
+		uint8_t times; //!< number of flashes
+		uint16_t wait; //!< time (ms) on, then off
+	};
+
+	uint8_t pin;
+	Flash queue[LED_PATTERN_QUEUE];
+	uint8_t head; //!< index of the pattern playing
+	uint8_t count; //!< number of queued patterns
+	uint8_t steps; //!< toggles left of the pattern playing, 0 if it hasn't started
+	unsigned long nextAt; //!< time of the next toggle
+
+public:
+	/**	Constructor.
+	 *
+	 *	@param pin Pin of the LED, set as output by the caller
+	 */
+	LedPattern(uint8_t pin) : pin(pin), head(0), count(0), steps(0) {};
+
+	/**	Queue a pattern. It is played after the patterns queued before.
+	 *
+	 *	@param times Number of flashes
+	 *	@param wait Time (ms) the LED is on, then off, for each flash
+	 *	@return false if the queue is full
+	 */
+	boolean flash(uint8_t times, uint16_t wait)
+	{
+		if (count == LED_PATTERN_QUEUE || times == 0)
+			return false;
+		Flash& f = queue[(head + count++) % LED_PATTERN_QUEUE];
+		f.times = times;
+		f.wait = wait;
+		return true;
+	};
+
+	//! Returns true while a pattern is playing or queued
+	boolean busy() { return count != 0; };
+
+	//! Toggle the LED when due. Call from loop().
+	void service()
+	{
+		if (count == 0 || (steps != 0 && (long)(millis() - nextAt) < 0))
+			return;
+		Flash& f = queue[head];
+		if (steps == 0)
+			steps = 2 * f.times;
+		else if (--steps == 0)
+		{
+			// the LED was off for the last time, start the next pattern on the next call
+			head = (head + 1) % LED_PATTERN_QUEUE;
+			count--;
+			return;
+		}
+		digitalWrite(pin, steps & 1 ? LOW : HIGH);
+		nextAt = millis() + f.wait;
+	};
+};
+
+#endif // LEDPATTERN_h
@@ -0,0 +1,88 @@
+/**
+ * 	@file	tagbatch.h
+ * 	@brief	Packs several tag reads into one XBee payload
+ *
+ *	<p>
+ *	Each record is the length of the tag number, the tag type and the tag
+ *	number itself, so records of 4- and 7-byte tag numbers can be mixed:
+ *	</p>
+ *	<pre>
+ *	length(1) type(1) number(length) [length(1) type(1) number(length) ...]
+ *	</pre>
+ *	<p>
+ *	The batch is due for sending when the next record might not fit, or
+ *	when its oldest record has waited for the batching window.
+ *	</p>
+ */
+
+#ifndef TAGBATCH_h
+#define TAGBATCH_h
+
+#if defined(ARDUINO) && ARDUINO >= 100
+#include "Arduino.h"
+#else
+#include "WProgram.h"
+#endif
+
+#define TAG_RECORD_MAX 9 // size of the largest record: length, type and a 7-byte tag number
+
+/**	Tag records waiting to be sent in one payload.
+ *
+ *	@tparam SIZE Capacity in bytes, the payload left after the message type
+ */
+template <uint8_t SIZE>
+class TagBatch
+{
+	static_assert(SIZE >= TAG_RECORD_MAX, "a batch must hold at least one record");
+
+	uint8_t buffer[SIZE];
+	uint8_t length; //!< number of bytes used
+	uint8_t records; //!< number of records
+	unsigned long started; //!< time the first record was added
+	unsigned int window; //!< time (ms) a record may wait for others
+
+public:
+	/**	Constructor.
+	 *
+	 *	@param window Time (ms) a record may wait for others before the batch is due
+	 */
+	TagBatch(unsigned int window) : length(0), records(0), window(window) {};
+
+	/**	Add a tag record.
+	 *
+	 *	@param type Tag type
+	 *	@param number Tag number
+	 *	@param numberLength Length of the tag number
+	 *	@return false if the record doesn't fit, send the batch first
+	 */
+	boolean add(uint8_t type, const uint8_t* number, uint8_t numberLength)
+	{
+		if (length + numberLength + 2 > SIZE)
+			return false;
+		if (length == 0)
+			started = millis();
+		buffer[length++] = numberLength;
+		buffer[length++] = type;
+		memcpy(buffer + length, number, numberLength);
+		length += numberLength;
+		records++;
+		return true;
+	};
+
+	//! Returns true if the batch should be sent: another record might not fit, or the window has passed
+	boolean due()
+	{
+		return length > 0 && (length + TAG_RECORD_MAX > SIZE || millis() - started >= window);
+	};
+
+	//! Returns the records
+	uint8_t* data() { return buffer; };
+	//! Returns the number of bytes of the records
+	uint8_t size() { return length; };
+	//! Returns the number of records
+	uint8_t count() { return records; };
+	//! Remove all records, after sending them
+	void clear() { length = records = 0; };
+};
+
+#endif // TAGBATCH_h
@@ -0,0 +1,121 @@
+/**
+ * 	@file	tagcache.h
+ * 	@brief	Recently seen tags, to report each tap once
+ *
+ *	<p>
+ *	The reader finds a tag resting on it again at every seek. The cache
+ *	remembers each tag number with the time it was last read, so a read
+ *	is only reported when the tag wasn't read within the hold-off time.
+ *	A tag that hasn't been read for the hold-off time has left the field,
+ *	and is handed out once by departed().
+ *	</p>
+ */
+
+#ifndef TAGCACHE_h
+#define TAGCACHE_h
+
+#if defined(ARDUINO) && ARDUINO >= 100
+#include "Arduino.h"
+#else
+#include "WProgram.h"
+#endif
+
+#define TAG_NUMBER_MAX 7 // longest tag number (bytes)
+
+/**	Fixed-size cache of the tags read most recently.
+ *
+ *	When the cache is full, a new tag replaces the one read least recently.
+ *
+ *	@tparam SIZE Number of tags remembered
+ */
+template <uint8_t SIZE>
+class TagCache
+{
+	struct Entry
+	{
+		uint8_t length; //!< length of the tag number, 0 if the entry is free
+		uint8_t type; //!< tag type
+		uint8_t number[TAG_NUMBER_MAX];
+		unsigned long seenAt; //!< time the tag was last read
+	};
+
+	Entry entries[SIZE];
+	unsigned int holdOff; //!< time (ms) without reads after which a tag has left
+
+public:
+	/**	Constructor.
+	 *
+	 *	@param holdOff Time (ms) without reads after which a tag has left the field
+	 */
+	TagCache(unsigned int holdOff) : holdOff(holdOff)
+	{
+		for (uint8_t i = 0; i < SIZE; i++)
+			entries[i].length = 0;
+	};
+
+	/**	Record a tag read.
+	 *
+	 *	@param type Tag type
+	 *	@param number Tag number
+	 *	@param length Length of the tag number
+	 *	@return true if the tag arrived, false if it was read within the hold-off time
+	 */
+	boolean seen(uint8_t type, const uint8_t* number, uint8_t length)
+	{
+		if (length > TAG_NUMBER_MAX)
+			length = TAG_NUMBER_MAX;
+		unsigned long now = millis();
+		Entry* oldest = entries;
+		for (uint8_t i = 0; i < SIZE; i++)
+		{
+			Entry& entry = entries[i];
+			if (entry.length == length && entry.type == type && memcmp(entry.number, number, length) == 0)
+			{
+				boolean arrived = now - entry.seenAt >= holdOff;
+				entry.seenAt = now;
+				return arrived;
+			}
+			if (oldest->length != 0 && (entry.length == 0 || entry.seenAt - oldest->seenAt > 0x7fffffffUL))
+				oldest = &entry;
+		}
+		oldest->length = length;
+		oldest->type = type;
+		memcpy(oldest->number, number, length);
+		oldest->seenAt = now;
+		return true;
+	};
+
+	/**	Remove a tag that has left the field.
+	 *
+	 *	@param type Set to the tag type
+	 *	@param number Set to the tag number, at least TAG_NUMBER_MAX bytes
+	 *	@param length Set to the length of the tag number
+	 *	@return false if no tag left
+	 */
+	boolean departed(uint8_t* type, uint8_t* number, uint8_t* length)
+	{
+		unsigned long now = millis();
+		for (uint8_t i = 0; i < SIZE; i++)
+		{
+			Entry& entry = entries[i];
+			if (entry.length != 0 && now - entry.seenAt >= holdOff)
+			{
+				*type = entry.type;
+				*length = entry.length;
+				memcpy(number, entry.number, entry.length);
+				entry.length = 0;
+				return true;
+			}
+		}
+		return false;
+	};
+
+	//! Forget all tags
+	void clear()
+	{
+		for (uint8_t i = 0; i < SIZE; i++)
+			entries[i].length = 0;
+	};
+};
+
+#endif // TAGCACHE_h
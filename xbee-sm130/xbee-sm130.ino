@@ -36,28 +36,91 @@
 
 #define XBEE_MASTER 0x0001
 
+// SM130 DREADY pin. Wire it to an external interrupt pin (2 or 3 on the Uno)
+// to stop polling the SM130 over I2C, or 0xFF if not connected.
+#define RFID_DREADY_PIN 0xFF
+
 #define TEST_MSG 't'
 #define TAGNUMBER_MSG 'n'
 #define FIRMWARE_MSG 'f'
 #define PING_MSG 'p'
+#define TAGBATCH_MSG 'b' // tag records of tagbatch.h
+#define TAGLEFT_MSG 'l' // tag number of a tag that left the reader
+
+// Time (ms) a tag read waits for others to share its frame, 0 to send
+// each tag in its own TAGNUMBER_MSG frame.
+#define TAG_BATCH_WINDOW 50
+
+// A tag read again within TAG_HOLDOFF (ms) of its last read is still resting
+// on the reader and isn't reported again. Set TAG_REPORT_DEPARTURE to 1 to
+// send a TAGLEFT_MSG once a tag hasn't been read for that long.
+#define TAG_HOLDOFF 1000
+#define TAG_CACHE_SIZE 8
+#define TAG_REPORT_DEPARTURE 0
+
+// Tag frames that weren't delivered are kept in EEPROM and sent again in
+// order, in the background, while frames get through. While they don't,
+// the oldest is tried again every EVENT_LOG_RETRY ms.
+#define EVENT_LOG_START 0
+#define EVENT_LOG_SIZE (E2END + 1 - EVENT_LOG_START)
+#define EVENT_LOG_RETRY 5000
+
+// Context of the queued frames, passed back to tx_status()
+#define FRAME_LIVE 0
+#define FRAME_REPLAY 1
 
 //Prototypes
 void send_to_xbee(int destinationAddr, uint8_t cmd, uint8_t* data, size_t dataLen);
+void report_tag(uint8_t type, uint8_t* number, uint8_t length);
+boolean send_tag_batch();
 void get_rfid_version();
 void flashLed(int pin, int times, int wait);
+void tx_status(uint8_t status, const uint8_t* payload, uint8_t length, uint8_t context);
+boolean is_tag_event(uint8_t cmd);
+void replay_event();
 
 #if RUN_MODE != RFID_TEST_MODE
-#ifdef HAS_SERIAL
+// The XBee link uses a buffered hardware serial port: Serial1 where the board
+// has one, else Serial when it isn't needed for debug output. SoftwareSerial
+// is only the fallback, it can't reliably receive at 115200.
+#if defined(HAVE_HWSERIAL1) || !defined(HAS_SERIAL)
+#include <bufferedserial.h>
+#define XBEE_RX_BUFFER 128
+#define XBEE_TX_BUFFER 128 // holds a whole frame, see XBEE_TX_FRAME()
+byte xbeeRxBuffer[XBEE_RX_BUFFER];
+byte xbeeTxBuffer[XBEE_TX_BUFFER];
+#ifdef HAVE_HWSERIAL1
+BufferedSerial xbeeSerial(Serial1, xbeeRxBuffer, sizeof(xbeeRxBuffer), xbeeTxBuffer, sizeof(xbeeTxBuffer));
+#else
+BufferedSerial xbeeSerial(Serial, xbeeRxBuffer, sizeof(xbeeRxBuffer), xbeeTxBuffer, sizeof(xbeeTxBuffer));
+#endif
+#else
 #include <SoftwareSerial.h>
 SoftwareSerial xbeeSerial(10, 9);
-#else
-#define xbeeSerial Serial
 #endif
 XBee xbee = XBee();
+#include "xbeetxqueue.h"
+#if defined(HAVE_HWSERIAL1) || !defined(HAS_SERIAL)
+static_assert(XBEE_TX_BUFFER >= XBEE_TX_FRAME(XBEE_TX_PAYLOAD), "the transmit ring must hold any frame");
+XBeeTxQueue txQueue(xbee, &xbeeSerial); // frames wait for room, the ring would drop what doesn't fit
+#else
+XBeeTxQueue txQueue(xbee); // SoftwareSerial blocks on write
+#endif
+#include "tagbatch.h"
+TagBatch<XBEE_TX_PAYLOAD - 1> tagBatch(TAG_BATCH_WINDOW);
+#include "eventlog.h"
+static_assert(EVENT_LOG_DATA >= XBEE_TX_PAYLOAD, "the event log must hold any frame");
+EventLog eventLog(EVENT_LOG_START, EVENT_LOG_SIZE);
+boolean linkUp = true; // false from a failed frame until a frame gets through
+boolean replaying = false; // true while an event of the log is in flight
+uint16_t replaySequence; // sequence number of that event
+unsigned long replayedAt; // time it was sent
 #endif
 
 #if RUN_MODE != XBEE_TEST_MODE
 SM130 nfc;
+#include "tagcache.h"
+TagCache<TAG_CACHE_SIZE> tagCache(TAG_HOLDOFF);
 #endif
 
 #ifdef ARDUINO_AVR_MINI
@@ -68,6 +131,10 @@ int statusLed = 5;
 int errorLed = 4;
 #endif
 
+#include "ledpattern.h"
+LedPattern statusPattern(statusLed);
+LedPattern errorPattern(errorLed);
+
 void debugPrint(const char *str) {
 #ifdef HAS_SERIAL
   Serial.print(str);
@@ -102,14 +169,18 @@ void setup() {
 #if RUN_MODE != RFID_TEST_MODE
   xbeeSerial.begin(XBEE_RATE);
   xbee.setSerial(xbeeSerial);
+  txQueue.onStatus(tx_status);
+  eventLog.begin();
   delay(100);
 #endif
 
 #if RUN_MODE != XBEE_TEST_MODE
 
   nfc.pinRESET = 0xFF;
-  nfc.pinDREADY = 0xFF;
+  nfc.pinDREADY = RFID_DREADY_PIN;
+  nfc.useInterrupt = true; // ignored if DREADY isn't on an interrupt pin
   //nfc.debug = true;
+  nfc.async = true; // don't block loop() while waiting for the SM130
   nfc.reset();
 
   get_rfid_version();
@@ -120,20 +191,38 @@ void setup() {
 }
 
 void loop() {
+  statusPattern.service();
+  errorPattern.service();
+#ifdef XBEE_RX_BUFFER
+  xbeeSerial.service(); // keep the port's own buffers empty
+#endif
+#if RUN_MODE != RFID_TEST_MODE
+  txQueue.service(); // match TX status responses of frames in flight
+  eventLog.service(); // write undelivered events to EEPROM a byte at a time
+  replay_event();
+#if RUN_MODE != XBEE_TEST_MODE
+  if (tagBatch.due())
+    send_tag_batch();
+#endif
+#endif
+
 #if RUN_MODE == XBEE_TEST_MODE
+  // one test frame a second, without stalling the LED patterns
+  static unsigned long lastTest = 0;
+  if (millis() - lastTest >= 1000) {
+    lastTest = millis();
     uint8_t payload2[] = { 't', 'e', 's', 't' };
-    send_to_xbee(XBEE_MASTER, TEST_MSG, payload2, sizeof(payload));
-
-    delay(1000);
+    send_to_xbee(XBEE_MASTER, TEST_MSG, payload2, sizeof(payload2));
+  }
 #else
   //nfc.selectTag();
 	if (nfc.available()) {
-    if (nfc.getTagType() != 0) {
+    if (nfc.getTagType() != 0 && tagCache.seen(nfc.getTagType(), nfc.getTagNumber(), nfc.getTagLength())) {
       debugPrint(nfc.getTagName());
       debugPrint(": ");
       debugPrintln(nfc.getTagString());      
 #if RUN_MODE != RFID_TEST_MODE
-      send_to_xbee(XBEE_MASTER, TAGNUMBER_MSG, nfc.getTagNumber(), nfc.getTagLength());
+      report_tag(nfc.getTagType(), nfc.getTagNumber(), nfc.getTagLength());
 #endif
     
     }
@@ -141,6 +230,16 @@ void loop() {
     nfc.seekTag();
 
 	}
+
+#if TAG_REPORT_DEPARTURE
+  uint8_t type, number[TAG_NUMBER_MAX], length;
+  if (tagCache.departed(&type, number, &length)) {
+    debugPrintln("Tag left");
+#if RUN_MODE != RFID_TEST_MODE
+    send_to_xbee(XBEE_MASTER, TAGLEFT_MSG, number, length);
+#endif
+  }
+#endif
 #endif
 
 	//delay(100);
@@ -155,54 +254,108 @@ void get_rfid_version()
 #endif
 }
 
+#if RUN_MODE != RFID_TEST_MODE && RUN_MODE != XBEE_TEST_MODE
+// Send a tag read to the master, batched with other reads within TAG_BATCH_WINDOW
+void report_tag(uint8_t type, uint8_t* number, uint8_t length)
+{
+	if (TAG_BATCH_WINDOW == 0) {
+		send_to_xbee(XBEE_MASTER, TAGNUMBER_MSG, number, length);
+		return;
+	}
+	if (tagBatch.add(type, number, length))
+		return;
+	// the batch is full, send it to make room
+	if (!send_tag_batch()) {
+		// the queue is full, keep the batch in the event log until the link catches up
+		uint8_t frame[XBEE_TX_PAYLOAD];
+		frame[0] = TAGBATCH_MSG;
+		memcpy(frame + 1, tagBatch.data(), tagBatch.size());
+		if (!eventLog.store(frame, tagBatch.size() + 1))
+			flashLed(errorLed, 2, 50);
+		tagBatch.clear();
+	}
+	tagBatch.add(type, number, length);
+}
+
+// Queue the batched tag reads in one TAGBATCH_MSG frame. Returns false if the queue is full.
+boolean send_tag_batch()
+{
+	if (txQueue.full())
+		return false;
+	send_to_xbee(XBEE_MASTER, TAGBATCH_MSG, tagBatch.data(), tagBatch.size());
+	tagBatch.clear();
+	return true;
+}
+#endif
+
 #if RUN_MODE != RFID_TEST_MODE
 void send_to_xbee(int destinationAddr, uint8_t cmd, uint8_t* data, size_t dataLen)
 {
 	//xbeeSerial.listen(); // uno cannot listen to 2 ports at same time.
 
-	uint8_t dataPacket[dataLen+1];
+	uint8_t dataPacket[XBEE_TX_PAYLOAD];
+	if (dataLen + 1 > sizeof(dataPacket)) {
+		flashLed(errorLed, 2, 50);
+		return;
+	}
 	dataPacket[0] = cmd;
 	memcpy(dataPacket+1, data, dataLen);
-	Tx16Request tx(destinationAddr, dataPacket, dataLen+1);
-	
-	xbee.send(tx);
-
-	// flash TX indicator
-	flashLed(statusLed, 1, 200);
-
-	xbee.readPacket();
-	XBeeResponse& response = xbee.getResponse();
-
-	// after sending a tx request, we expect a status response
-	// wait up to 5 seconds for the status response
-	if (xbee.getResponse().isAvailable()) {
-		// got a response!
-
-		// should be a znet tx status            	
-		if (response.getApiId() == TX_STATUS_RESPONSE) {
-
-			TxStatusResponse txStatus;
-			response.getZBTxStatusResponse(txStatus);
-
-			// get the delivery status, the fifth byte
-			if (txStatus.getStatus() == SUCCESS) {
-				// success.  time to celebrate
-				flashLed(statusLed, 5, 50);
-			}
-			else {
-				// the remote XBee did not receive our packet. is it powered on?
-				flashLed(errorLed, 3, 500);
-			}
-		}
+
+	// the TX status is matched by txQueue.service() on a later loop()
+	if (!txQueue.send(destinationAddr, dataPacket, dataLen+1)) {
+		// queue full, the radio is falling behind
+		if (is_tag_event(cmd))
+			eventLog.store(dataPacket, dataLen+1);
+		flashLed(errorLed, 2, 50);
 	}
-	else if (response.isError()) {
-		//nss.print("Error reading packet.  Error code: ");  
-		//nss.println(xbee.getResponse().getErrorCode());
-		// or flash error led
+}
+
+// Returns true for the messages that are kept in the event log until delivered
+boolean is_tag_event(uint8_t cmd)
+{
+	return cmd == TAGNUMBER_MSG || cmd == TAGBATCH_MSG || cmd == TAGLEFT_MSG;
+}
+
+// Send the oldest undelivered event again, leaving room in the queue for new reads
+void replay_event()
+{
+	if (replaying || eventLog.pending() == 0 || txQueue.queued() + 1 >= XBEE_TX_QUEUE)
+		return;
+	if (!linkUp && millis() - replayedAt < EVENT_LOG_RETRY)
+		return;
+	uint8_t event[EVENT_LOG_DATA];
+	uint8_t length = eventLog.peek(event, &replaySequence);
+	if (txQueue.send(XBEE_MASTER, event, length, FRAME_REPLAY)) {
+		replaying = true;
+		replayedAt = millis();
+	}
+}
+
+// Called by txQueue with the outcome of each frame
+void tx_status(uint8_t status, const uint8_t* payload, uint8_t length, uint8_t context)
+{
+	if (context == FRAME_REPLAY) {
+		// a failed replay stays in the log
+		replaying = false;
+		if (status == SUCCESS)
+			eventLog.remove(replaySequence);
+	}
+	else if (status != SUCCESS && is_tag_event(payload[0])) {
+		eventLog.store(payload, length);
+	}
+	linkUp = status == SUCCESS;
+
+	if (status == SUCCESS) {
+		// success.  time to celebrate
+		flashLed(statusLed, 5, 50);
+	}
+	else if (status == XBEE_TX_NO_STATUS) {
+		// no status response from the local XBee
 		flashLed(errorLed, 4, 100);
 	}
 	else {
-		flashLed(errorLed, 2, 50);
+		// the remote XBee did not receive our packet. is it powered on?
+		flashLed(errorLed, 3, 500);
 	}
 }
 #endif
@@ -217,16 +370,8 @@ uint8_t lo_word(uint16_t t)
 	return (t & 0xff);
 }
 
+// Queue a flash pattern, played by loop() without blocking
 void flashLed(int pin, int times, int wait) {
-
-	for (int i = 0; i < times; i++) {
-		digitalWrite(pin, HIGH);
-		delay(wait);
-		digitalWrite(pin, LOW);
-
-		if (i + 1 < times) {
-			delay(wait);
-		}
-	}
+	(pin == errorLed ? errorPattern : statusPattern).flash(times, wait);
 }
 
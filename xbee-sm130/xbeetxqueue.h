@@ -0,0 +1,207 @@
+/**
+ * 	@file	xbeetxqueue.h
+ * 	@brief	Outbound XBee frame queue with asynchronous TX status
+ *
+ *	<p>
+ *	Each frame gets a frame ID, so the XBee answers it with a TX status
+ *	response once the remote radio acknowledged it or gave up. Instead of
+ *	waiting for that response after every frame, the queue copies the
+ *	payload, transmits up to XBEE_TX_WINDOW frames back to back, and
+ *	matches status responses by frame ID in service(), called from loop().
+ *	The status callback reports each frame's outcome, with a time-out for
+ *	statuses that never arrive.
+ *	</p>
+ *	<p>
+ *	Given the serial port of the XBee, a frame is only sent when the port
+ *	can take all of it, escaped bytes included. A port such as
+ *	BufferedSerial that drops what doesn't fit in its transmit buffer would
+ *	otherwise cut a frame short, and the radio would discard it and the
+ *	frame after it.
+ *	</p>
+ */
+
+#ifndef XBEETXQUEUE_h
+#define XBEETXQUEUE_h
+
+#include <XBee.h>
+
+#define XBEE_TX_QUEUE 4 // frames waiting to be sent or for their status
+#define XBEE_TX_PAYLOAD 48 // maximum payload of a queued frame (the radio takes up to 100 bytes)
+#define XBEE_TX_WINDOW 2 // frames sent before their status arrived
+#define XBEE_TX_TIMEOUT 1000 // time-out (ms) for the TX status of a frame
+#define XBEE_TX_NO_STATUS 0xff // status reported when no TX status arrived in time
+
+// Bytes on the wire of a Tx16 frame with a payload, when every byte after the start delimiter is escaped
+#define XBEE_TX_FRAME(length) (1 + 2 * (8 + (length)))
+
+/**	Called with the outcome of each frame: SUCCESS, a TX status code, or
+ *	XBEE_TX_NO_STATUS, and the context the frame was queued with. The
+ *	payload is valid until the function returns.
+ */
+typedef void (*xbee_tx_callback_t)(uint8_t status, const uint8_t* payload, uint8_t length, uint8_t context);
+
+/**	Queue of frames to send with a Tx16Request.
+ */
+class XBeeTxQueue
+{
+	enum { FREE, QUEUED, SENT };
+
+	struct Frame
+	{
+		uint8_t state; //!< FREE, QUEUED or SENT
+		uint8_t frameId; //!< frame ID the TX status refers to, while SENT
+		uint16_t destination; //!< 16-bit address of the remote radio
+		unsigned long sentAt; //!< time the frame was sent
+		uint8_t length; //!< number of payload bytes
+		uint8_t context; //!< passed to the callback
+		uint8_t payload[XBEE_TX_PAYLOAD];
+	};
+
+	XBee* xbee;
+	Print* port; //!< serial port of the XBee, checked for room before each frame, or 0
+	Frame frames[XBEE_TX_QUEUE];
+	uint8_t order[XBEE_TX_QUEUE]; //!< indices of the used frames, oldest first
+	uint8_t count; //!< number of used frames
+	uint8_t nextFrameId; //!< frame ID of the next frame sent, never 0
+	xbee_tx_callback_t callback;
+	TxStatusResponse txStatus;
+
+	//! Free the frame at position i of the queue, and report its outcome
+	void complete(uint8_t i, uint8_t status)
+	{
+		uint8_t index = order[i];
+		frames[index].state = FREE;
+		for (; i + 1 < count; i++)
+			order[i] = order[i + 1];
+		order[--count] = index;
+
+		// the callback may queue a frame in the freed slot
+		if (callback)
+		{
+			uint8_t payload[XBEE_TX_PAYLOAD];
+			uint8_t length = frames[index].length;
+			memcpy(payload, frames[index].payload, length);
+			callback(status, payload, length, frames[index].context);
+		}
+	};
+
+	//! Number of frames waiting for their status
+	uint8_t inFlight()
+	{
+		uint8_t n = 0;
+		for (uint8_t i = 0; i < count; i++)
+			n += frames[order[i]].state == SENT;
+		return n;
+	};
+
+public:
+	/**	Constructor.
+	 *
+	 *	@param xbee XBee connected to its serial port
+	 *	@param port Serial port of the XBee if its write() drops bytes when
+	 *	full, its availableForWrite() must reach XBEE_TX_FRAME(XBEE_TX_PAYLOAD).
+	 *	0 for a port that blocks instead, such as SoftwareSerial.
+	 */
+	XBeeTxQueue(XBee& xbee, Print* port = 0) : xbee(&xbee), port(port), count(0), nextFrameId(1), callback(0)
+	{
+		for (uint8_t i = 0; i < XBEE_TX_QUEUE; i++)
+		{
+			frames[i].state = FREE;
+			order[i] = i;
+		}
+	};
+
+	//! Set the function called with the outcome of each frame
+	void onStatus(xbee_tx_callback_t callback) { this->callback = callback; };
+
+	//! Returns the number of frames waiting to be sent or for their status
+	uint8_t queued() { return count; };
+
+	//! Returns true if no more frames can be queued
+	boolean full() { return count == XBEE_TX_QUEUE; };
+
+	/**	Queue a frame. It is sent right away if the window allows.
+	 *
+	 *	@param destination 16-bit address of the remote radio
+	 *	@param payload Payload, copied into the queue
+	 *	@param length Number of payload bytes, at most XBEE_TX_PAYLOAD
+	 *	@param context Passed to the callback with the outcome of the frame
+	 *	@return false if the queue is full or the payload too long
+	 */
+	boolean send(uint16_t destination, const uint8_t* payload, uint8_t length, uint8_t context = 0)
+	{
+		if (full() || length > XBEE_TX_PAYLOAD)
+			return false;
+		Frame& frame = frames[order[count++]];
+		frame.state = QUEUED;
+		frame.destination = destination;
+		frame.length = length;
+		frame.context = context;
+		memcpy(frame.payload, payload, length);
+		transmit();
+		return true;
+	};
+
+	/**	Match received TX status responses, time out frames without status,
+	 *	and send queued frames. Call from loop().
+	 *
+	 *	Frames can be queued from the status callback.
+	 */
+	void service()
+	{
+		// Read what the radio sent so far, without waiting
+		xbee->readPacket();
+		XBeeResponse& response = xbee->getResponse();
+		if (response.isAvailable() && response.getApiId() == TX_STATUS_RESPONSE)
+		{
+			response.getTxStatusResponse(txStatus);
+			for (uint8_t i = 0; i < count; i++)
+			{
+				Frame& frame = frames[order[i]];
+				if (frame.state == SENT && frame.frameId == txStatus.getFrameId())
+				{
+					complete(i, txStatus.getStatus());
+					break;
+				}
+			}
+		}
+
+		// Give up on frames whose status never came
+		for (uint8_t i = 0; i < count;)
+		{
+			Frame& frame = frames[order[i]];
+			if (frame.state == SENT && millis() - frame.sentAt > XBEE_TX_TIMEOUT)
+				complete(i, XBEE_TX_NO_STATUS);
+			else
+				i++;
+		}
+
+		transmit();
+	};
+
+private:
+	//! Send the oldest queued frames while the window allows, and the port has room for them
+	void transmit()
+	{
+		uint8_t sent = inFlight();
+		for (uint8_t i = 0; i < count && sent < XBEE_TX_WINDOW; i++)
+		{
+			Frame& frame = frames[order[i]];
+			if (frame.state != QUEUED)
+				continue;
+			// wait for room for the whole frame, service() tries again
+			if (port && port->availableForWrite() < XBEE_TX_FRAME(frame.length))
+				break;
+			Tx16Request tx(frame.destination, frame.payload, frame.length);
+			tx.setFrameId(nextFrameId);
+			xbee->send(tx);
+			frame.frameId = nextFrameId;
+			frame.state = SENT;
+			frame.sentAt = millis();
+			nextFrameId = nextFrameId == 0xff ? 1 : nextFrameId + 1;
+			sent++;
+		}
+	};
+};
+
+#endif // XBEETXQUEUE_h